@@ -6,6 +6,8 @@
 
 #include <string>
 #include <vector>
+#include <array>
+#include <cstdint>
 
 std::string escaped(std::string source, const std::string& term, const std::string& replacement) {
 	size_t i(0);
@@ -114,6 +116,58 @@ protected:
 	char* m_data;
 };
 
+// Writes the low bytes bytes of value into out, most significant first
+void putBigEndian(char* out, uint64_t value, size_t bytes = 8) {
+	for (size_t i = bytes; i--;) {
+		out[i] = (char)(value & 0xff);
+		value >>= 8;
+	}
+}
+
+// Reads a value of bytes bytes written by putBigEndian
+uint64_t getBigEndian(const char* in, size_t bytes = 8) {
+	uint64_t value(0);
+	for (size_t i = 0; i < bytes; ++i) {
+		value = (value << 8) | (unsigned char)in[i];
+	}
+	return value;
+}
+
+// Returns the value of a hex digit, or -1 if c isn't one
+int hexValue(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+// Returns the CRC-32 of size bytes at data (the one used by zlib and PNG), continuing from the CRC of whatever preceded them
+uint32_t crc32(const char* data, size_t size, uint32_t crc = 0) {
+	static const std::array<uint32_t, 256> table([]() {
+		std::array<uint32_t, 256> t;
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c(i);
+			for (int k = 0; k < 8; ++k) {
+				c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			}
+			t[i] = c;
+		}
+		return t;
+	}());
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i) {
+		crc = table[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
 // Returns prefix+suffix as a c-string (equivalent)
 CStr appended(std::string prefix, const std::string& suffix) {
 	prefix += suffix;
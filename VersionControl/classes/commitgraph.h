@@ -0,0 +1,452 @@
+// commitgraph.h: Defines the CommitGraph class, which summarizes the history of the repository in a single file
+
+#ifndef COMMITGRAPH_H
+#define COMMITGRAPH_H
+#pragma once
+
+#include "../../date/include/date/date.h"
+#include "hero.h"
+#include "crossplatform.h"
+#include "commitreader.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+// Converts the date and time written in a commit header (like "2018-03-01" and "15:04:05 UTC") into seconds since 1970
+// The time may be left out, for midnight. Returns false if they could not be parsed.
+bool parseCommitTime(const std::string& day, const std::string& time, int64_t& seconds) {
+	int y;
+	unsigned m, d, hours(0), minutes(0), secs(0);
+	if (sscanf(day.c_str(), "%d-%u-%u", &y, &m, &d) != 3 || m < 1 || m > 12 || d < 1 || d > 31) {
+		return false;
+	}
+	if (time.size() && (sscanf(time.c_str(), "%u:%u:%u", &hours, &minutes, &secs) != 3 || hours > 23 || minutes > 59 || secs > 60)) {
+		return false;
+	}
+
+	date::sys_days days(date::year(y) / date::month(m) / date::day(d));
+	seconds = (int64_t)days.time_since_epoch().count() * 86400 + hours * 3600 + minutes * 60 + secs;
+	return true;
+}
+
+// Formats seconds since 1970 as the date and time written in a commit header
+std::string commitDate(int64_t seconds) {
+	std::chrono::system_clock::time_point clock(std::chrono::seconds((long long)seconds));
+	std::ostringstream out;
+	out << date::year_month_day(date::floor<date::days>(clock));
+	return out.str();
+}
+
+std::string commitTime(int64_t seconds) {
+	std::chrono::system_clock::time_point clock(std::chrono::seconds((long long)seconds));
+	std::ostringstream out;
+	out << date::make_time(date::floor<std::chrono::seconds>(clock - date::floor<date::days>(clock))) << " UTC";
+	return out.str();
+}
+
+// A summary of every commit in the repository: Its hash, its parent, when it was made, and its title and message
+// The history can be walked through the graph without opening any commit.
+// The graph only ever holds what's in the commits themselves, so it's rebuilt from them if it's missing, damaged, or names a commit which is gone.
+// On disk, the graph is a binary file which is mapped into memory rather than parsed:
+//   A 24-byte header: "HEROCGPH", then the format version and the number of commits in the table, then the size of the text pool
+//   The table: A 60-byte entry per commit, sorted by hash.
+//     Each is the raw SHA256 of the commit, the position of its parent in the table (all ones for the root), its time in seconds since 1970,
+//     the offset of its title in the pool, then the lengths of its title and message, which follows the title
+//   The pool: Every title and message, escaped as they are in their commits
+//   Commits added since the table was written, one record each, in the order they were added (so parents come before their children)
+//     Each is the type 'A', the raw SHA256s of the commit and its parent (all zeroes for the root), its time,
+//     the lengths of its title and message, the title and the message, then the CRC-32 of everything before it in the record
+//   The times and pool offset are 8 bytes, and every other number 4 bytes. All are big-endian.
+// Commits past the table are numbered after it. Once there are enough of them next to the table, saving writes a new table.
+// Cannot be copied.
+class CommitGraph {
+public:
+	using Hash = std::string;
+
+	static const uint32_t VERSION = 1;
+	static const size_t HEADER_SIZE = 24;
+	static const size_t ENTRY_SIZE = 60;
+	static const size_t RECORD_SIZE = 81; // Before the title and message
+	static const size_t MIN_RECORDS = 64; // The table is never rewritten to take in fewer records than this
+	static const size_t NONE = (size_t)-1;
+	static const uint32_t ROOT = 0xffffffffu;
+
+	CommitGraph() : CommitGraph(repositoryPath(COMMITGRAPH_PATH).asStdString()) {}
+	explicit CommitGraph(const std::string& location) : m_location(location), m_table(nullptr), m_pool(nullptr), m_count(0), m_saved(0), m_compact(true) {
+		load();
+	}
+
+	// The number of commits in the graph
+	size_t size() const {
+		return m_count + m_added.size();
+	}
+
+	// Returns the position of the commit with the given hash, or NONE if it isn't in the graph
+	size_t find(const Hash& hash) const {
+		char digest[32];
+		if (!digestFromHex(hash, digest)) {
+			return NONE;
+		}
+
+		size_t low(0), high(m_count);
+		while (low < high) {
+			size_t middle(low + (high - low) / 2);
+			int order(memcmp(digest, m_table + middle * ENTRY_SIZE, 32));
+			if (!order) {
+				return middle;
+			}
+			else if (order < 0) {
+				high = middle;
+			}
+			else {
+				low = middle + 1;
+			}
+		}
+
+		auto it(m_positions.find(hash));
+		return it == m_positions.end() ? NONE : it->second;
+	}
+
+	bool contains(const Hash& hash) const {
+		return find(hash) != NONE;
+	}
+
+	// Returns the hashes of the commits in the graph which start with prefix (given in hex), stopping once max have been found
+	std::vector<Hash> findPrefix(const std::string& prefix, size_t max) const {
+		std::vector<Hash> found;
+
+		// Binary search for the first entry at or after the prefix, comparing in hex so prefixes can end mid-byte
+		size_t low(0), high(m_count);
+		while (low < high) {
+			size_t middle(low + (high - low) / 2);
+			if (hash(middle).compare(0, prefix.size(), prefix) < 0) {
+				low = middle + 1;
+			}
+			else {
+				high = middle;
+			}
+		}
+		for (size_t i = low; i < m_count && found.size() < max; ++i) {
+			Hash candidate(hash(i));
+			if (candidate.compare(0, prefix.size(), prefix)) {
+				break;
+			}
+			found.push_back(candidate);
+		}
+
+		for (auto it = m_positions.lower_bound(prefix); it != m_positions.end() && found.size() < max && !it->first.compare(0, prefix.size(), prefix); ++it) {
+			found.push_back(it->first);
+		}
+		return found;
+	}
+
+	// Returns the shortest prefix of hash, no shorter than minimum, which no other commit in the graph starts with
+	Hash abbreviate(const Hash& hash, size_t minimum = 7) const {
+		for (size_t length = minimum; length < hash.size(); ++length) {
+			if (findPrefix(hash.substr(0, length), 2).size() < 2) {
+				return hash.substr(0, length);
+			}
+		}
+		return hash;
+	}
+
+	Hash hash(size_t i) const {
+		return i < m_count ? hexFromDigest(m_table + i * ENTRY_SIZE) : m_added[i - m_count].hash;
+	}
+
+	// Returns the position of the parent of the commit at i, or NONE if it's the root
+	size_t parent(size_t i) const {
+		if (i >= m_count) {
+			return m_added[i - m_count].parent;
+		}
+		uint64_t parent(getBigEndian(m_table + i * ENTRY_SIZE + 32, 4));
+		return parent == ROOT ? NONE : (size_t)parent;
+	}
+
+	// The time the commit at i was made, in seconds since 1970
+	int64_t time(size_t i) const {
+		return i < m_count ? (int64_t)getBigEndian(m_table + i * ENTRY_SIZE + 36) : m_added[i - m_count].time;
+	}
+
+	// The title and message are returned as stored, still escaped
+	std::string title(size_t i) const {
+		if (i >= m_count) {
+			return m_added[i - m_count].title;
+		}
+		const char* entry(m_table + i * ENTRY_SIZE);
+		return std::string(m_pool + getBigEndian(entry + 44), (size_t)getBigEndian(entry + 52, 4));
+	}
+
+	std::string message(size_t i) const {
+		if (i >= m_count) {
+			return m_added[i - m_count].message;
+		}
+		const char* entry(m_table + i * ENTRY_SIZE);
+		return std::string(m_pool + getBigEndian(entry + 44) + getBigEndian(entry + 52, 4), (size_t)getBigEndian(entry + 56, 4));
+	}
+
+	// Adds the commit with the given hash to the graph, along with any of its ancestors which are missing, by reading their commits
+	// Returns false, setting failed to the hash of the first commit which could not be read, if any could not be.
+	bool update(const Hash& hash, Hash& failed) {
+		std::vector<Added> missing;
+		for (Hash current(hash); current != "0" && !contains(current);) {
+			CommitReader commit(current);
+			int64_t seconds;
+			if (!commit) {
+				failed = current;
+				return false;
+			}
+			if (!parseCommitTime(commit.date(), commit.time(), seconds)) {
+				seconds = 0;
+			}
+
+			Added added;
+			added.hash = current;
+			added.parentHash = commit.parent();
+			added.time = seconds;
+			added.title = commit.title();
+			added.message = commit.message();
+			missing.push_back(added);
+
+			current = commit.parent();
+		}
+
+		// Add them oldest first, so each parent has a position by the time its child is added
+		for (auto it = missing.rbegin(); it != missing.rend(); ++it) {
+			it->parent = find(it->parentHash);
+			m_positions[it->hash] = size();
+			m_added.push_back(*it);
+		}
+		return true;
+	}
+
+	// Writes the commits added since the graph was loaded to disk
+	// Returns whether the graph was saved
+	bool save() {
+		if (m_saved == m_added.size() && !m_compact) {
+			return true;
+		}
+
+		if (!m_compact && (m_added.size() <= MIN_RECORDS || m_added.size() <= m_count / 8)) {
+			std::string records;
+			for (size_t i = m_saved; i < m_added.size(); ++i) {
+				writeRecord(records, m_added[i]);
+			}
+			if (appendToFile(m_location, records.data(), records.size())) {
+				m_saved = m_added.size();
+				return true;
+			}
+		}
+		return compact();
+	}
+protected:
+	// A commit which isn't in the table
+	struct Added {
+		Hash hash;
+		Hash parentHash;
+		size_t parent;
+		int64_t time;
+		std::string title;
+		std::string message;
+	};
+
+	// Maps the graph, and reads the commits recorded after the table
+	// A graph which can't be read is treated as empty, and rewritten when saved.
+	void load() {
+		m_file.reset(new MappedFile(m_location));
+		const MappedFile& file(*m_file);
+		if (!file || file.size() < HEADER_SIZE || memcmp(file.data(), "HEROCGPH", 8) || getBigEndian(file.data() + 8, 4) != VERSION) {
+			m_file.reset();
+			return;
+		}
+
+		const char* data(file.data());
+		uint64_t count(getBigEndian(data + 12, 4));
+		uint64_t pool(getBigEndian(data + 16));
+		if (count * ENTRY_SIZE > file.size() - HEADER_SIZE || pool > file.size() - HEADER_SIZE - count * ENTRY_SIZE) {
+			m_file.reset();
+			return;
+		}
+
+		m_table = data + HEADER_SIZE;
+		m_pool = m_table + count * ENTRY_SIZE;
+		m_count = (size_t)count;
+		m_compact = false;
+
+		// Read the commits added since, stopping at any record which is incomplete or damaged
+		size_t position((size_t)(HEADER_SIZE + count * ENTRY_SIZE + pool));
+		size_t size((size_t)file.size());
+		while (position < size) {
+			if (size - position < RECORD_SIZE || data[position] != 'A') {
+				break;
+			}
+			uint64_t text(getBigEndian(data + position + 73, 4) + getBigEndian(data + position + 77, 4));
+			if (text + 4 > size - position - RECORD_SIZE) {
+				break;
+			}
+			size_t length((size_t)(RECORD_SIZE + text));
+			if (getBigEndian(data + position + length, 4) != crc32(data + position, length)) {
+				break;
+			}
+
+			Added added;
+			added.hash = hexFromDigest(data + position + 1);
+			added.parentHash = hexFromDigest(data + position + 33);
+			if (added.parentHash == std::string(64, '0')) {
+				added.parentHash = "0";
+			}
+			added.parent = find(added.parentHash);
+			added.time = (int64_t)getBigEndian(data + position + 65);
+			added.title.assign(data + position + RECORD_SIZE, (size_t)getBigEndian(data + position + 73, 4));
+			added.message.assign(data + position + RECORD_SIZE + added.title.size(), (size_t)getBigEndian(data + position + 77, 4));
+			m_positions[added.hash] = this->size();
+			m_added.push_back(added);
+
+			position += length + 4;
+		}
+		m_saved = m_added.size();
+
+		// Anything left over was cut short: Rewrite the graph to be rid of it
+		if (position < size) {
+			m_compact = true;
+		}
+
+		// hero never removes a commit, but hero-repofix replaces them when it rewrites history, and they can be deleted by hand.
+		// A graph naming any commit which isn't there is out of date as a whole, so it's dropped, and rebuilt from the commits as they're read.
+		if (!commitsExist()) {
+			clear();
+		}
+	}
+
+	// Returns whether every commit in the graph is in the commits directory, which is listed once rather than checked commit by commit
+	bool commitsExist() const {
+		std::vector<std::string> names;
+		if (filesInDirectory(repositoryPath("commits"), names)) {
+			return false;
+		}
+		std::sort(names.begin(), names.end());
+		for (size_t i = 0; i < size(); ++i) {
+			if (!std::binary_search(names.begin(), names.end(), hash(i))) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Empties the graph, so the next save writes a whole new one
+	void clear() {
+		m_file.reset();
+		m_table = nullptr;
+		m_pool = nullptr;
+		m_count = 0;
+		m_added.clear();
+		m_positions.clear();
+		m_saved = 0;
+		m_compact = true;
+	}
+
+	static void writeRecord(std::string& out, const Added& added) {
+		char header[RECORD_SIZE];
+		header[0] = 'A';
+		digestFromHex(added.hash, header + 1);
+		if (!digestFromHex(added.parentHash, header + 33)) {
+			memset(header + 33, 0, 32);
+		}
+		putBigEndian(header + 65, (uint64_t)added.time);
+		putBigEndian(header + 73, added.title.size(), 4);
+		putBigEndian(header + 77, added.message.size(), 4);
+
+		std::string record(header, RECORD_SIZE);
+		record += added.title;
+		record += added.message;
+		char crc[4];
+		putBigEndian(crc, crc32(record.data(), record.size()), 4);
+		out += record;
+		out.append(crc, 4);
+	}
+
+	// Writes every commit into a new table, replacing the old graph
+	bool compact() {
+		// Order every commit by hash, and work out where each one's parent ends up
+		size_t total(size());
+		std::vector<std::pair<Hash, size_t>> order;
+		order.reserve(total);
+		for (size_t i = 0; i < total; ++i) {
+			order.emplace_back(hash(i), i);
+		}
+		std::sort(order.begin(), order.end());
+		std::vector<size_t> moved(total);
+		for (size_t i = 0; i < total; ++i) {
+			moved[order[i].second] = i;
+		}
+
+		std::string table, pool;
+		table.reserve(total * ENTRY_SIZE);
+		for (const auto& commit : order) {
+			size_t i(commit.second);
+			std::string title(this->title(i)), message(this->message(i));
+
+			char entry[ENTRY_SIZE];
+			digestFromHex(commit.first, entry);
+			putBigEndian(entry + 32, parent(i) == NONE ? ROOT : moved[parent(i)], 4);
+			putBigEndian(entry + 36, (uint64_t)time(i));
+			putBigEndian(entry + 44, pool.size());
+			putBigEndian(entry + 52, title.size(), 4);
+			putBigEndian(entry + 56, message.size(), 4);
+			table.append(entry, ENTRY_SIZE);
+			pool += title;
+			pool += message;
+		}
+
+		char header[HEADER_SIZE];
+		memcpy(header, "HEROCGPH", 8);
+		putBigEndian(header + 8, VERSION, 4);
+		putBigEndian(header + 12, total, 4);
+		putBigEndian(header + 16, pool.size());
+
+		std::string partial(m_location + "_PARTIAL");
+		std::ofstream out(partial, std::ios::out | std::ios::binary | std::ios::trunc);
+		out.write(header, HEADER_SIZE);
+		out.write(table.data(), table.size());
+		out.write(pool.data(), pool.size());
+		out.close();
+		if (!out || !syncFile(partial)) {
+			remove(partial.c_str());
+			return false;
+		}
+
+		// The old graph must be unmapped before it can be replaced everywhere
+		clear();
+		if (!replaceFile(partial, m_location)) {
+			remove(partial.c_str());
+			return false;
+		}
+		syncDirectory(parentDirectory(m_location));
+		load();
+		return true;
+	}
+protected:
+	std::string m_location;
+	std::unique_ptr<MappedFile> m_file;
+	const char* m_table;
+	const char* m_pool;
+	size_t m_count;
+
+	std::vector<Added> m_added; // Commits past the table, numbered from m_count
+	std::map<Hash, size_t> m_positions; // Where each of them is
+	size_t m_saved; // How many of them are on disk
+	bool m_compact; // Whether the next save must write a whole new table
+
+private:
+	CommitGraph(const CommitGraph&);
+};
+#endif // !COMMITGRAPH_H
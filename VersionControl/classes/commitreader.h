@@ -0,0 +1,496 @@
+// commitreader.h: Defines the CommitReader class, which provides random access to the files stored in a commit
+
+#ifndef COMMITREADER_H
+#define COMMITREADER_H
+#pragma once
+
+#include "hero.h"
+#include "crossplatform.h"
+#include "compression.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+#include <iterator>
+
+// The location of a single file inside of a commit blob
+struct CommitEntry {
+	std::string path; // Path of the file in the working directory
+	std::string checksum; // SHA256 of the file contents, as recorded in the commit
+	uint64_t offset; // Offset of the first byte of the file contents from the beginning of the commit, if they are embedded
+	uint64_t size; // Size of the file contents, in bytes
+	bool embedded; // Whether the contents are stored in the commit itself, rather than in the object store under the checksum
+	std::string encoding; // How the contents were stored in the object store when committed, or empty if they were stored unmodified
+};
+
+// Reads a commit in the format specified in commit-blob.txt
+// File contents may be embedded in the commit, as older commits store them, or stored in the object store.
+// The header is parsed on construction. The table of files is only built when it is first requested:
+//   It is loaded from the sidecar index written alongside the commit if one exists, or otherwise built by scanning the commit once.
+// Once the table exists, the contents of any file can be reached with a single seek.
+// If the files or footer turn out to be malformed when they're read, the reader stops being good, so callers should check it again afterwards.
+// Cannot be copied.
+class CommitReader {
+public:
+	using Filename = std::string;
+	using Hash = std::string;
+
+	static const size_t BUFFER_SIZE = 1 << 16; // Size of the block used to copy file contents out of the commit
+
+	explicit CommitReader(const Hash& hash) : m_hash(hash), m_location(repositoryPath("commits/" + hash).asStdString()), m_good(false), m_scanned(false), m_footerRead(false), m_filesStart(0), m_footer(0), m_count(0), m_size(0) {
+		m_file.open(m_location, std::ios::in | std::ios::binary);
+		if (m_file) {
+			m_good = readHeader();
+		}
+	}
+
+	explicit operator bool() const {
+		return m_good;
+	}
+
+	// Returns the path of the sidecar index for the commit stored at location
+	static std::string indexPath(const std::string& location) {
+		return location + ".idx";
+	}
+
+	// Writes a sidecar index for a commit, given its file table and the offset of its footer
+	// The index replaces any old one in a single step, so a reader never sees part of it.
+	// Returns whether the index was written successfully
+	static bool writeIndex(const std::string& location, const std::vector<CommitEntry>& files, uint64_t footer) {
+		std::ostringstream out;
+
+		// Version 2 indices record each file's encoding. Indices without a version line are version 1, and have none.
+		out << "version 2\n";
+		out << "footer " << footer << "\n";
+		for (const auto& entry : files) {
+			// Files in the object store have no offset, and unencoded files have no encoding: A dash stands in for either
+			if (entry.embedded) {
+				out << entry.offset;
+			}
+			else {
+				out << "-";
+			}
+			out << " " << entry.size << " " << entry.checksum << " " << (entry.encoding.size() ? entry.encoding : "-") << " " << entry.path << "\n";
+		}
+		return writeFileDurably(location, out.str());
+	}
+
+	const Hash& hash() const {
+		return m_hash;
+	}
+
+	// The path of the commit blob on disk
+	const std::string& location() const {
+		return m_location;
+	}
+
+	const Hash& parent() const {
+		return m_parent;
+	}
+
+	const std::string& date() const {
+		return m_date;
+	}
+
+	const std::string& time() const {
+		return m_time;
+	}
+
+	// The title and message are returned as stored, still escaped
+	const std::string& title() const {
+		return m_title;
+	}
+
+	const std::string& message() const {
+		return m_message;
+	}
+
+	// The files listed in the commit header
+	const std::vector<Filename>& listedFiles() const {
+		return m_listed;
+	}
+
+	// The table of files stored in the commit, in the order they are stored
+	const std::vector<CommitEntry>& files() {
+		if (!m_scanned) {
+			loadFiles();
+		}
+		return m_files;
+	}
+
+	// Returns the entry for path, or nullptr if the commit does not contain it
+	const CommitEntry* find(const Filename& path) {
+		if (m_lookup.empty()) {
+			for (size_t i = 0; i < files().size(); ++i) {
+				m_lookup[m_files[i].path] = i;
+			}
+		}
+		auto it(m_lookup.find(path));
+		if (it == m_lookup.end()) {
+			return nullptr;
+		}
+		return &m_files[it->second];
+	}
+
+	// The number of files the commit footer claims the commit holds
+	size_t count() {
+		if (!m_footerRead) {
+			readFooter();
+		}
+		return m_count;
+	}
+
+	// The total size the commit footer claims the files in the commit have
+	uint64_t size() {
+		if (!m_footerRead) {
+			readFooter();
+		}
+		return m_size;
+	}
+
+	// Copies the contents of the file described by entry into out, from the commit or from the object store
+	// Files in the object store may be copied from several threads at once, but embedded files share the commit's stream.
+	// Returns whether all of the file could be copied
+	bool copyTo(const CommitEntry& entry, std::ostream& out) {
+		std::ifstream object;
+		std::istream* source(&m_file);
+		if (entry.embedded) {
+			m_file.clear();
+			m_file.seekg(entry.offset);
+		}
+		else if (entry.encoding == encoding::LZ4) {
+			object.open(objectPath(entry.checksum, entry.encoding), std::ios::in | std::ios::binary);
+			return encoding::decode(object, [&out](const char* data, size_t size) { out.write(data, size); }) && out;
+		}
+		else {
+			object.open(objectPath(entry.checksum), std::ios::in | std::ios::binary);
+			source = &object;
+		}
+		std::vector<char> buffer(BUFFER_SIZE);
+
+		uint64_t remaining(entry.size);
+		while (remaining) {
+			size_t block(remaining < BUFFER_SIZE ? (size_t)remaining : BUFFER_SIZE);
+			if (!source->read(buffer.data(), block)) {
+				return false;
+			}
+			out.write(buffer.data(), block);
+			remaining -= block;
+		}
+		return bool(out);
+	}
+protected:
+	// Reads a line, discarding any carriage return left by a text-mode writer
+	bool getline(std::string& line) {
+		std::getline(m_file, line);
+		if (line.size() && line.back() == '\r') {
+			line.pop_back();
+		}
+		return bool(m_file);
+	}
+
+	// Parses the commit header, leaving the read pointer at the first file section
+	// Returns whether the header was well formed
+	bool readHeader() {
+		std::string line;
+		if (!getline(line) || line != "COMMIT HEADER") {
+			return false;
+		}
+		getline(line); // Discard the three ampersands that delineate the header
+
+		while (getline(line) && line != "&&&&&") {
+			size_t space(line.find(' '));
+			std::string key(line.substr(0, space));
+			std::string value(space == std::string::npos ? "" : line.substr(space + 1));
+
+			if (key == "parent") {
+				m_parent = value;
+			}
+			else if (key == "date") {
+				m_date = value;
+			}
+			else if (key == "time") {
+				m_time = value;
+			}
+			else if (key == "title") {
+				m_title = value;
+			}
+			else if (key == "message") {
+				// The message is delimited by ampersands, and may span many lines.
+				size_t end(value.find('&', 1));
+				if (end != std::string::npos) {
+					m_message = value.substr(1, end - 1);
+				}
+				else {
+					m_message = value.substr(1) + "\n";
+					std::getline(m_file, line, '&');
+					m_message += line;
+					getline(line); // Discard the remainder of the line
+				}
+			}
+			else if (key == "files") {
+				// 1 skips the '[', and the list ends with a comma and a ']'
+				std::stringstream list(value.substr(1, value.size() > 1 ? value.size() - 2 : 0));
+				while (std::getline(list, line, ',')) {
+					if (line.size()) {
+						m_listed.push_back(line);
+					}
+				}
+			}
+		}
+
+		if (!m_file) {
+			return false;
+		}
+		m_filesStart = m_file.tellg();
+		return true;
+	}
+
+	void loadFiles() {
+		m_scanned = true;
+		m_files.clear();
+		if (!m_good) {
+			return;
+		}
+
+		if (!loadIndex()) {
+			m_files.clear();
+			scanFiles();
+		}
+
+	}
+
+	// Attempts to fill the file table from the sidecar index
+	// The index is read in one piece and split in place, since it holds a line for every file in the commit.
+	// Returns false if there is no usable index, including one which is corrupt: The index is only an accelerator, so the caller can scan instead
+	bool loadIndex() {
+		std::ifstream index(indexPath(m_location), std::ios::in | std::ios::binary);
+		if (!index) {
+			return false;
+		}
+		std::string text((std::istreambuf_iterator<char>(index)), std::istreambuf_iterator<char>());
+
+		size_t start(0);
+		std::string line;
+		nextLine(text, start, line);
+		uint64_t version(1);
+		if (!line.find("version ")) {
+			const char* number(line.c_str() + 8); // 8 characters: "version "
+			if (!readNumber(number, version) || *number) {
+				return false;
+			}
+			nextLine(text, start, line);
+		}
+		if (version > 2 || line.find("footer ")) {
+			return false;
+		}
+		const char* number(line.c_str() + 7); // 7 characters: "footer "
+		if (!readNumber(number, m_footer) || *number) {
+			return false;
+		}
+
+		while (start < text.size()) {
+			size_t end(text.find('\n', start));
+			if (end == std::string::npos) {
+				end = text.size();
+			}
+			const char* field(text.c_str() + start);
+			const char* last(text.c_str() + end);
+			start = end + 1;
+
+			CommitEntry entry;
+			entry.offset = 0;
+			entry.embedded = (*field != '-');
+			if (!entry.embedded) {
+				++field;
+			}
+			else if (!readNumber(field, entry.offset)) {
+				return false;
+			}
+			if (!readNumber(field, entry.size) || !readWord(field, last, entry.checksum)) {
+				return false;
+			}
+			if (version >= 2) {
+				if (!readWord(field, last, entry.encoding)) {
+					return false;
+				}
+				if (entry.encoding == "-") {
+					entry.encoding.clear();
+				}
+			}
+			if (*field == ' ') { // Skip the separating space: the rest of the line is the path
+				++field;
+			}
+			entry.path.assign(field, last);
+			m_files.push_back(std::move(entry));
+		}
+		return true;
+	}
+
+	// Sets line to the line of text starting at start, and moves start past it
+	static void nextLine(const std::string& text, size_t& start, std::string& line) {
+		size_t end(std::min(text.find('\n', start), text.size()));
+		line = text.substr(start, end - start);
+		start = end + 1;
+	}
+
+	// Reads a space-separated decimal number at field into value, and moves field past it
+	// Returns whether there was a number
+	static bool readNumber(const char*& field, uint64_t& value) {
+		while (*field == ' ') {
+			++field;
+		}
+		if (!isdigit(static_cast<unsigned char>(*field))) {
+			return false;
+		}
+		char* end;
+		value = strtoull(field, &end, 10);
+		field = end;
+		return true;
+	}
+
+	// Reads the number making up the rest of line, after a key of the given length, into value
+	// Returns whether the rest of the line was exactly one number
+	static bool readField(const std::string& line, size_t key, uint64_t& value) {
+		const char* field(line.c_str() + key);
+		return readNumber(field, value) && !*field;
+	}
+
+	// Marks the commit as malformed, so the reader is no longer good, and forgets any files already found in it
+	void malformed() {
+		m_good = false;
+		m_files.clear();
+		m_lookup.clear();
+		m_count = 0;
+		m_size = 0;
+	}
+
+	// Reads a space-separated word at field, ending no later than last, into word, and moves field past it
+	// Returns whether there was a word
+	static bool readWord(const char*& field, const char* last, std::string& word) {
+		while (field < last && *field == ' ') {
+			++field;
+		}
+		const char* end(std::find(field, last, ' '));
+		if (end == field) {
+			return false;
+		}
+		word.assign(field, end);
+		field = end;
+		return true;
+	}
+
+	// Fills the file table by walking every file section once, seeking past the contents of each file
+	void scanFiles() {
+		m_file.clear();
+		m_file.seekg(m_filesStart);
+
+		std::string line;
+		while (true) {
+			uint64_t position(m_file.tellg());
+			if (!getline(line)) {
+				return;
+			}
+			if (line == "COMMIT FOOTER") { // The footer is not a file, so we're done.
+				m_footer = position;
+				return;
+			}
+
+			CommitEntry entry;
+			entry.path = line;
+			entry.offset = 0;
+			entry.size = 0;
+			entry.embedded = false;
+
+			// The file header ends with three ampersands if the contents follow, or five if they're in the object store
+			while (getline(line) && line != "&&&" && line != "&&&&&") {
+				if (!line.find("checksum ")) {
+					entry.checksum = line.substr(std::string("checksum ").size());
+				}
+				else if (!line.find("size ")) {
+					if (!readField(line, 5, entry.size)) { // 5 characters: "size "
+						malformed();
+						return;
+					}
+				}
+				else if (!line.find("encoding ")) {
+					entry.encoding = line.substr(std::string("encoding ").size());
+				}
+			}
+
+			if (line == "&&&") {
+				entry.embedded = true;
+				entry.offset = m_file.tellg();
+
+				// Skip the contents, then the five ampersands marking the end of the file
+				m_file.seekg(entry.offset + entry.size);
+				getline(line);
+			}
+
+			m_files.push_back(entry);
+		}
+	}
+
+	void readFooter() {
+		m_footerRead = true;
+		files(); // Make sure we know where the footer is
+		if (!m_good || !m_footer) {
+			return;
+		}
+
+		m_file.clear();
+		m_file.seekg(m_footer);
+
+		std::string line;
+		getline(line); // "COMMIT FOOTER"
+		getline(line); // Discard the three ampersands that delineate the commit footer's header
+		while (getline(line) && line != "&&&&&") {
+			uint64_t count;
+			if (!line.find("count ")) {
+				if (!readField(line, 6, count)) { // 6 characters: "count "
+					malformed();
+					return;
+				}
+				m_count = (size_t)count;
+			}
+			else if (!line.find("size ")) {
+				if (!readField(line, 5, m_size)) { // 5 characters: "size "
+					malformed();
+					return;
+				}
+			}
+		}
+	}
+protected:
+	Hash m_hash;
+	std::string m_location;
+	std::ifstream m_file;
+	bool m_good;
+	bool m_scanned;
+	bool m_footerRead;
+
+	Hash m_parent;
+	std::string m_date;
+	std::string m_time;
+	std::string m_title;
+	std::string m_message;
+	std::vector<Filename> m_listed;
+
+	uint64_t m_filesStart;
+	uint64_t m_footer;
+	std::vector<CommitEntry> m_files;
+	std::map<Filename, size_t> m_lookup;
+
+	size_t m_count;
+	uint64_t m_size;
+
+private:
+	CommitReader(const CommitReader&);
+};
+#endif // !COMMITREADER_H
@@ -0,0 +1,122 @@
+// commitwriter.h: Defines the CommitWriter class, which streams a commit to disk while hashing it
+
+#ifndef COMMITWRITER_H
+#define COMMITWRITER_H
+#pragma once
+
+#include "../../PicoSHA2/picosha2.h"
+#include "hero.h"
+#include "crossplatform.h"
+#include "commitreader.h"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdint>
+
+// Writes a commit into a temporary file in the commits directory, updating the commit's SHA256 as bytes are written.
+// File contents normally live in the object store, so a commit is mostly just the list of its files, recorded with addObject().
+//   addEntry() records contents the caller embeds in the commit itself, which only hero-repofix does, for ones it can't trust.
+// The temporary file is named for this process, so two commits being written at once can't overwrite each other.
+// When the commit is complete, finish() flushes the temporary file to disk and renames it to the commit's hash.
+// If the files in the commit were recorded, a sidecar index is written beside the commit for CommitReader.
+// If the writer is destroyed before finish() succeeds, the temporary file is removed.
+// Cannot be copied.
+class CommitWriter {
+public:
+	CommitWriter() : CommitWriter(repositoryPath("commits").asStdString()) {}
+	explicit CommitWriter(const std::string& directory) : m_directory(directory), m_location(directory + "/COMMIT_PARTIAL_" + std::to_string(processId())), m_written(0), m_footer(0), m_finished(false) {
+		m_file.open(m_location, std::ios::out | std::ios::binary | std::ios::trunc);
+	}
+
+	~CommitWriter() {
+		if (!m_finished) {
+			m_file.close();
+			remove(m_location.c_str());
+		}
+	}
+
+	explicit operator bool() const {
+		return !m_finished && bool(m_file);
+	}
+
+	// Writes size bytes from data into the commit
+	CommitWriter& write(const char* data, size_t size) {
+		m_file.write(data, size);
+		m_hasher.update(data, size);
+		m_written += size;
+		return *this;
+	}
+
+	CommitWriter& write(const std::string& data) {
+		return write(data.c_str(), data.size());
+	}
+
+	// Formats value as an ostream would, then writes it into the commit
+	template <class T> CommitWriter& operator << (const T& value) {
+		m_format.str("");
+		m_format << value;
+		return write(m_format.str());
+	}
+
+	// Records that the contents of the file at path, of the given size and checksum, begin at the current position
+	void addEntry(const std::string& path, const std::string& checksum, uint64_t size) {
+		m_entries.push_back(CommitEntry{ path, checksum, m_written, size, true, "" });
+	}
+
+	// Records that the contents of the file at path, of the given size and checksum, are in the object store with the given encoding
+	void addObject(const std::string& path, const std::string& checksum, uint64_t size, const std::string& encoding = "") {
+		m_entries.push_back(CommitEntry{ path, checksum, 0, size, false, encoding });
+	}
+
+	// Records that the commit footer begins at the current position
+	void markFooter() {
+		m_footer = m_written;
+	}
+
+	// Completes the commit, and moves it to its final location in the commits directory
+	// Returns the hash of the commit, or an empty string if the commit could not be written
+	std::string finish() {
+		if (!*this) {
+			return "";
+		}
+
+		m_file.close();
+		if (!m_file) {
+			return "";
+		}
+
+		std::string hash(m_hasher.hexDigest());
+
+		// The commit must be on disk under its own name before anything refers to it. If the target exists, it holds this exact commit.
+		std::string target(m_directory + "/" + hash);
+		remove(CommitReader::indexPath(target).c_str());
+		if (!syncFile(m_location) || !replaceFile(m_location, target) || !syncDirectory(m_directory)) {
+			return "";
+		}
+
+		m_finished = true;
+
+		// The sidecar index is only an accelerator: CommitReader can still scan the commit if writing it fails.
+		if (m_footer) {
+			CommitReader::writeIndex(CommitReader::indexPath(target), m_entries, m_footer);
+		}
+		return hash;
+	}
+protected:
+	std::string m_directory;
+	std::string m_location;
+	std::ofstream m_file;
+	Hasher m_hasher;
+	std::ostringstream m_format;
+	std::vector<CommitEntry> m_entries;
+	uint64_t m_written;
+	uint64_t m_footer;
+	bool m_finished;
+
+private:
+	CommitWriter(const CommitWriter&);
+};
+#endif // !COMMITWRITER_H
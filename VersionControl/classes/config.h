@@ -0,0 +1,58 @@
+// config.h: Defines the Config class, which reads the repository configuration file
+
+#ifndef CONFIG_H
+#define CONFIG_H
+#pragma once
+
+#include "hero.h"
+
+#include <string>
+#include <map>
+#include <fstream>
+#include <cstdlib>
+
+// Reads the settings in .hero/config, one per line, as a key and a value separated by a space
+// Blank lines, and lines starting with '#', are ignored. A repository with no config file uses the defaults everywhere.
+// Recognized settings:
+//   compression <level>: Compress the contents of newly committed files with LZ4, trying harder at higher levels (1 to 9). 0 disables compression.
+//   staging <copy|link>: Whether add copies files into the index (the default), or hard links them there, so their contents are only copied at commit.
+//     Linked files which are changed in place before they're committed are committed as they are then, with a warning.
+class Config {
+public:
+	Config() : Config(repositoryPath("config").asStdString()) {}
+	explicit Config(const std::string& location) {
+		std::ifstream file(location, std::ios::in | std::ios::binary);
+		std::string line;
+		while (std::getline(file, line)) {
+			if (line.size() && line.back() == '\r') {
+				line.pop_back();
+			}
+			if (!line.size() || line[0] == '#') {
+				continue;
+			}
+
+			size_t space(line.find(' '));
+			m_values[line.substr(0, space)] = space == std::string::npos ? "" : line.substr(space + 1);
+		}
+	}
+
+	// Returns the value of key, or fallback if it isn't set
+	std::string get(const std::string& key, const std::string& fallback = "") const {
+		auto it(m_values.find(key));
+		return it == m_values.end() ? fallback : it->second;
+	}
+
+	// Returns the value of key as a number, or fallback if it isn't set or isn't a number
+	long getNumber(const std::string& key, long fallback) const {
+		auto it(m_values.find(key));
+		if (it == m_values.end()) {
+			return fallback;
+		}
+		char* end;
+		long value(strtol(it->second.c_str(), &end, 10));
+		return (end == it->second.c_str() || *end) ? fallback : value;
+	}
+protected:
+	std::map<std::string, std::string> m_values;
+};
+#endif // !CONFIG_H
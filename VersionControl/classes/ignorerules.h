@@ -0,0 +1,258 @@
+// ignorerules.h: Defines the IgnoreRules class, which decides which paths in the working directory are never added
+
+#ifndef IGNORERULES_H
+#define IGNORERULES_H
+#pragma once
+
+#include "hero.h"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <fstream>
+#include <cstdint>
+#include <algorithm>
+
+// Reads the patterns in .heroignore, in the root of the working directory, one per line, with the same meaning as in a .gitignore:
+//   Blank lines, and lines starting with '#', are ignored. A backslash makes the character after it literal.
+//   '*' matches anything but '/', '?' matches any one character but '/', and [...] matches one character from a set, as in [a-z] or [!0-9].
+//   A pattern ending in '/' only matches directories. A pattern starting with '!' re-includes what an earlier pattern ignored.
+//   A pattern with no '/' (other than at its end) matches names at any depth. Any other pattern matches paths from the root.
+//   '**/' matches any number of directories, and a trailing '/**' matches everything inside a directory.
+// The last pattern which matches a path decides whether it's ignored. Nothing inside an ignored directory can be re-included,
+//   since the directory isn't read at all.
+// Patterns are compiled once: Those without wildcards are looked up by name or path in a hash table,
+//   and the rest become a sequence of tokens matched with a table over positions, so no pattern costs more than a single pass.
+class IgnoreRules {
+public:
+	IgnoreRules() : IgnoreRules(IGNOREFILE_PATH) {}
+	explicit IgnoreRules(const std::string& location) {
+		std::ifstream file(location, std::ios::in | std::ios::binary);
+		std::string line;
+		while (std::getline(file, line)) {
+			add(line);
+		}
+	}
+
+	// Adds a pattern after every other one, so it takes precedence over them
+	void add(std::string line) {
+		if (line.size() && line.back() == '\r') {
+			line.pop_back();
+		}
+		// Trailing spaces are ignored, unless they're escaped
+		while (line.size() && line.back() == ' ' && !(line.size() > 1 && line[line.size() - 2] == '\\')) {
+			line.pop_back();
+		}
+		if (!line.size() || line[0] == '#') {
+			return;
+		}
+
+		Rule rule;
+		rule.negated = (line[0] == '!');
+		if (rule.negated) {
+			line.erase(0, 1);
+		}
+		rule.directoryOnly = (line.size() && line.back() == '/');
+		if (rule.directoryOnly) {
+			line.pop_back();
+		}
+		if (!line.size()) {
+			return;
+		}
+		rule.anchored = (line.find('/') != std::string::npos);
+		if (line[0] == '/') {
+			line.erase(0, 1);
+		}
+
+		size_t index(m_rules.size());
+		std::string literal;
+		if (compile(line, rule.tokens, literal)) {
+			auto& table(rule.anchored ? m_paths : m_names);
+			table[literal].push_back(index);
+		}
+		else {
+			m_patterns.push_back(index);
+		}
+		m_rules.push_back(rule);
+	}
+
+	// Returns whether the file or directory at path, relative to the root of the working directory, is ignored
+	bool ignored(const std::string& path, bool directory) const {
+		if (m_rules.empty()) {
+			return false;
+		}
+
+		std::string relative(path);
+#if defined(_WIN32)
+		std::replace(relative.begin(), relative.end(), '\\', '/');
+#endif
+		while (!relative.compare(0, 2, "./")) {
+			relative.erase(0, 2);
+		}
+		size_t slash(relative.find_last_of('/'));
+		std::string name(slash == std::string::npos ? relative : relative.substr(slash + 1));
+
+		// Find the last rule which matches, checking only patterns which come after the best literal match
+		size_t best(NONE);
+		lookup(m_names, name, directory, best);
+		lookup(m_paths, relative, directory, best);
+		for (auto it = m_patterns.rbegin(); it != m_patterns.rend() && (best == NONE || *it > best); ++it) {
+			const Rule& rule(m_rules[*it]);
+			if ((directory || !rule.directoryOnly) && match(rule.tokens, rule.anchored ? relative : name)) {
+				best = *it;
+				break;
+			}
+		}
+		return best != NONE && !m_rules[best].negated;
+	}
+
+	size_t size() const {
+		return m_rules.size();
+	}
+protected:
+	static const size_t NONE = SIZE_MAX;
+
+	// A piece of a compiled pattern
+	struct Token {
+		enum Type : uint8_t { LITERAL, ONE, SET, STAR, DIRECTORIES, ANYTHING } type;
+		std::string text; // The characters of a literal, or the characters in a set
+		bool negated; // Whether a set matches the characters not in it
+
+		explicit Token(Type t) : type(t), negated(false) {}
+	};
+
+	struct Rule {
+		std::vector<Token> tokens;
+		bool negated; // Whether the rule re-includes what it matches
+		bool directoryOnly;
+		bool anchored; // Whether the rule matches paths from the root, rather than names
+	};
+
+	std::vector<Rule> m_rules;
+	std::unordered_map<std::string, std::vector<size_t>> m_names; // The rules without wildcards which match names, by name
+	std::unordered_map<std::string, std::vector<size_t>> m_paths; // The rules without wildcards which match paths, by path
+	std::vector<size_t> m_patterns; // The rules with wildcards, in order
+
+	// Raises best to the last rule in table under key which can match
+	void lookup(const std::unordered_map<std::string, std::vector<size_t>>& table, const std::string& key, bool directory, size_t& best) const {
+		auto it(table.find(key));
+		if (it == table.end()) {
+			return;
+		}
+		for (auto rule = it->second.rbegin(); rule != it->second.rend(); ++rule) {
+			if (directory || !m_rules[*rule].directoryOnly) {
+				if (best == NONE || *rule > best) {
+					best = *rule;
+				}
+				return;
+			}
+		}
+	}
+
+	// Compiles pattern into tokens
+	// Returns true, and sets literal to what the pattern matches, if it has no wildcards
+	static bool compile(const std::string& pattern, std::vector<Token>& tokens, std::string& literal) {
+		for (size_t i = 0; i < pattern.size(); ++i) {
+			char c(pattern[i]);
+			if (c == '*') {
+				bool leading(i == 0 || pattern[i - 1] == '/');
+				if (i + 1 < pattern.size() && pattern[i + 1] == '*' && leading && (i + 2 == pattern.size() || pattern[i + 2] == '/')) {
+					if (i + 2 == pattern.size()) {
+						tokens.emplace_back(Token::ANYTHING); // A trailing "**"
+					}
+					else {
+						tokens.emplace_back(Token::DIRECTORIES); // "**/"
+					}
+					i += 2;
+				}
+				else {
+					while (i + 1 < pattern.size() && pattern[i + 1] == '*') {
+						++i; // "**" anywhere else is just '*'
+					}
+					tokens.emplace_back(Token::STAR);
+				}
+			}
+			else if (c == '?') {
+				tokens.emplace_back(Token::ONE);
+			}
+			else if (c == '[' && pattern.find(']', i + 2) != std::string::npos) {
+				Token set(Token::SET);
+				size_t j(i + 1);
+				if (pattern[j] == '!' || pattern[j] == '^') {
+					set.negated = true;
+					++j;
+				}
+				size_t end(pattern.find(']', j + 1));
+				for (; j < end; ++j) {
+					if (j + 2 < end && pattern[j + 1] == '-') {
+						for (int k = (unsigned char)pattern[j]; k <= (unsigned char)pattern[j + 2]; ++k) {
+							set.text += (char)k;
+						}
+						j += 2;
+					}
+					else {
+						set.text += pattern[j];
+					}
+				}
+				tokens.push_back(set);
+				i = end;
+			}
+			else {
+				if (c == '\\' && i + 1 < pattern.size()) {
+					c = pattern[++i];
+				}
+				if (tokens.empty() || tokens.back().type != Token::LITERAL) {
+					tokens.emplace_back(Token::LITERAL);
+				}
+				tokens.back().text += c;
+			}
+		}
+
+		if (tokens.size() == 1 && tokens[0].type == Token::LITERAL) {
+			literal = tokens[0].text;
+			return true;
+		}
+		return false;
+	}
+
+	// Returns whether tokens match the whole of text
+	// matches[i * (size + 1) + j] records whether the tokens from i on match the text from j on. It's filled from the end of both.
+	static bool match(const std::vector<Token>& tokens, const std::string& text) {
+		size_t size(text.size());
+		std::vector<char> matches((tokens.size() + 1) * (size + 1), 0);
+		matches[tokens.size() * (size + 1) + size] = 1;
+
+		for (size_t i = tokens.size(); i-- > 0;) {
+			const Token& token(tokens[i]);
+			char* here(&matches[i * (size + 1)]);
+			const char* next(&matches[(i + 1) * (size + 1)]);
+			for (size_t j = size + 1; j-- > 0;) {
+				bool more(j < size);
+				switch (token.type) {
+				case Token::LITERAL:
+					here[j] = j + token.text.size() <= size && !text.compare(j, token.text.size(), token.text) && next[j + token.text.size()];
+					break;
+				case Token::ONE:
+					here[j] = more && text[j] != '/' && next[j + 1];
+					break;
+				case Token::SET:
+					here[j] = more && text[j] != '/' && (token.text.find(text[j]) == std::string::npos) == token.negated && next[j + 1];
+					break;
+				case Token::STAR:
+					here[j] = next[j] || (more && text[j] != '/' && here[j + 1]);
+					break;
+				case Token::DIRECTORIES: {
+					size_t slash(text.find('/', j));
+					here[j] = next[j] || (slash != std::string::npos && here[slash + 1]);
+					break;
+				}
+				case Token::ANYTHING:
+					here[j] = 1;
+					break;
+				}
+			}
+		}
+		return matches[0] != 0;
+	}
+};
+#endif // !IGNORERULES_H
@@ -4,100 +4,644 @@
 #define INDEXMAP_H
 #pragma once
 
-#include "../../PicoSHA2/picosha2.h"
 #include "hero.h"
+#include "crossplatform.h"
 
 #include <string>
 #include <utility>
 #include <fstream>
+#include <iostream>
+#include <memory>
 #include <map>
+#include <set>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+// A file in the index: The hash of its contents, and what its metadata was when they were hashed
+// The metadata is all zeroes when it isn't known, or when it couldn't be trusted to change along with the contents.
+struct IndexEntry {
+	std::string hash;
+	FileStat stat;
+
+	IndexEntry() : stat() {}
+	IndexEntry(const std::string& h, const FileStat& s) : hash(h), stat(s) {}
+
+	// Returns whether a file with this metadata can be assumed to still hold these contents
+	bool matches(const FileStat& current) const {
+		return (stat.mtime || stat.ctime) && stat == current;
+	}
+};
+
+// The storage behind both kinds of indexmap: A table of every file in the index, keyed by path
+// On disk, the table is kept in a binary format which is mapped into memory rather than parsed:
+//   A 20-byte header: "HEROIMAP", then the format version, the number of entries in the table, and the size of the path pool
+//   The table: An 80-byte entry per file, sorted by path.
+//     Each is the raw SHA256 of the file, the offset and length of its path in the pool,
+//     then its modification time, change time, size, inode and device, as they were when it was hashed
+//   The pool: Every path, back to back
+//   A journal of the changes made since the table was written, as batches of records
+//     Each record is a type ('S' to set the entry for a path, or 'E' to erase it), a raw SHA256 and the five metadata fields (ignored for 'E'),
+//     the length of the path, then the path
+//     Each batch ends with a commit record: The type 'C', the number of records in the batch, then the CRC-32 of the batch's records
+// Version 1 tables had no metadata: Their entries are 40 bytes, and their records 37 bytes before the path.
+// Version 2 tables had no commit records: Every record counted as soon as it was complete. Older tables are rewritten as version 3 when saved.
+// The metadata fields are 8 bytes, and every other number is 4 bytes. All are big-endian.
+// Loading maps the file and replays the journal, so nothing is allocated for the entries in the table. Lookups binary search it.
+// Saving appends a batch holding a record for each change, and waits for it to reach the disk.
+// A batch which was cut short or garbled by a crash is ignored, along with anything after it, and the table is rewritten on the next save.
+// Once the journal is large enough next to the table that it's worth it, saving writes a new table to a temporary file and renames it into place instead.
+// Index maps written by older versions as text (a "filename,hash" line per file) are still read, and are rewritten as a table when saved.
+// Lookups by hash use a second index of every (hash, path) pair, built the first time it's needed and kept up to date from then on.
+class IndexTable {
+public:
+	using Filename = std::string;
+	using Hash = std::string;
+	using HashIndex = std::set<std::pair<Hash, Filename>>;
+
+	static const uint32_t VERSION = 3;
+	static const size_t HEADER_SIZE = 20;
+	static const size_t STAT_SIZE = 40;
+	static const size_t COMMIT_SIZE = 9;
+	static const size_t MIN_RECORDS = 64; // The table is never rewritten to compact fewer records than this
+
+	IndexTable() : m_table(nullptr), m_pool(nullptr), m_count(0), m_entrySize(entrySize(VERSION)), m_records(0), m_compact(true), m_size(0), m_indexed(true) {}
+	explicit IndexTable(const std::string& location) : IndexTable() {
+		load(location);
+	}
+
+	// The size of each entry in a table of the given version, and of each record before its path
+	static size_t entrySize(uint64_t version) {
+		return version < 2 ? 40 : 40 + STAT_SIZE;
+	}
+
+	static size_t recordSize(uint64_t version) {
+		return version < 2 ? 37 : 37 + STAT_SIZE;
+	}
+
+	// Sets entry to the entry for the file at path, if it's in the table
+	// Returns whether it was
+	bool find(const Filename& path, IndexEntry& entry) const {
+		for (const auto* overlay : { &m_changes, &m_loaded }) {
+			auto it(overlay->find(path));
+			if (it != overlay->end()) {
+				entry = it->second;
+				return entry.hash.size() > 0; // Erased paths are left in the overlay with no hash
+			}
+		}
+
+		size_t i;
+		if (!search(path, i)) {
+			return false;
+		}
+		entry = tableEntry(i);
+		return true;
+	}
+
+	bool find(const Filename& path, Hash& hash) const {
+		IndexEntry entry;
+		if (!find(path, entry)) {
+			return false;
+		}
+		hash = entry.hash;
+		return true;
+	}
+
+	bool exists(const Filename& path) const {
+		IndexEntry entry;
+		return find(path, entry);
+	}
+
+	// The number of files in the table, kept as it changes, so counting them costs nothing
+	size_t size() const {
+		return m_size;
+	}
+
+	bool empty() const {
+		return !m_size;
+	}
+
+	// Returns every file in the table, ordered by hash and then path
+	const HashIndex& byHash() const {
+		if (!m_indexed) {
+			m_byHash.clear();
+			forEach([this](const Filename& path, const IndexEntry& entry) {
+				m_byHash.emplace(entry.hash, path);
+			});
+			m_indexed = true;
+		}
+		return m_byHash;
+	}
+
+	// Returns the range of byHash() holding the files with the given contents
+	std::pair<HashIndex::const_iterator, HashIndex::const_iterator> findHash(const Hash& hash) const {
+		const HashIndex& index(byHash());
+		auto first(index.lower_bound(std::make_pair(hash, Filename())));
+		auto last(first);
+		while (last != index.end() && last->first == hash) {
+			++last;
+		}
+		return std::make_pair(first, last);
+	}
+
+	// Returns a reference to the hash of the file at path, through which it can be changed
+	// If the file isn't in the table, it's added with an empty hash, which must be filled in.
+	// The metadata of the file is forgotten, since the hash may no longer describe it.
+	Hash& slot(const Filename& path) {
+		m_indexed = false; // The hash can change behind our back, so the index by hash must be rebuilt
+		auto it(m_changes.find(path));
+		if (it == m_changes.end()) {
+			IndexEntry current;
+			find(path, current);
+			it = m_changes.emplace(path, current).first;
+		}
+		if (it->second.hash.empty()) {
+			++m_size; // Counted now, since the caller fills in the hash
+		}
+		it->second.stat = FileStat();
+		return it->second.hash;
+	}
+
+	void set(const Filename& path, const Hash& hash, const FileStat& stat = FileStat()) {
+		// Setting an entry to what it already is would only add to the journal
+		IndexEntry current;
+		bool existed(find(path, current));
+		if (existed && current.hash == hash && current.stat == stat) {
+			return;
+		}
+		if (!existed) {
+			++m_size;
+		}
+
+		unindex(path);
+		if (m_indexed) {
+			m_byHash.emplace(hash, path);
+		}
+		m_changes[path] = IndexEntry(hash, stat);
+	}
+
+	void erase(const Filename& path) {
+		if (exists(path)) {
+			--m_size;
+		}
+		unindex(path);
+		m_changes[path] = IndexEntry();
+	}
+
+	void clear() {
+		release();
+		m_changes.clear();
+		m_loaded.clear();
+		m_byHash.clear();
+		m_indexed = true;
+		m_records = 0;
+		m_compact = true;
+		m_size = 0;
+	}
+
+	// Calls f(path, entry) for every file in the table, in order of path
+	template <class F> void forEach(F f) const {
+		// Later changes take precedence
+		std::map<Filename, IndexEntry> overlay(m_loaded);
+		for (const auto& it : m_changes) {
+			overlay[it.first] = it.second;
+		}
+
+		auto change(overlay.begin());
+		for (size_t i = 0; i < m_count; ++i) {
+			const char* path(entryPath(i));
+			size_t length(entryLength(i));
+
+			while (change != overlay.end() && compare(change->first, path, length) < 0) {
+				if (change->second.hash.size()) {
+					f(change->first, change->second);
+				}
+				++change;
+			}
+			if (change != overlay.end() && !compare(change->first, path, length)) {
+				if (change->second.hash.size()) {
+					f(change->first, change->second);
+				}
+				++change;
+				continue;
+			}
+			f(Filename(path, length), tableEntry(i));
+		}
+		for (; change != overlay.end(); ++change) {
+			if (change->second.hash.size()) {
+				f(change->first, change->second);
+			}
+		}
+	}
+
+	// Writes the table to location, appending records of the changes made since it was loaded where possible
+	// Returns whether the table was saved
+	bool save(const std::string& location) {
+		if (!m_changes.size() && !m_compact) {
+			return true;
+		}
+
+		size_t records(m_records + m_changes.size());
+		if (!m_compact && (records <= MIN_RECORDS || records <= m_count / 4)) {
+			std::string batch;
+			for (const auto& it : m_changes) {
+				writeRecord(batch, it.first, it.second);
+			}
+			char commit[COMMIT_SIZE];
+			commit[0] = 'C';
+			putBigEndian(commit + 1, m_changes.size(), 4);
+			putBigEndian(commit + 5, crc32(batch.data(), batch.size()), 4);
+			batch.append(commit, COMMIT_SIZE);
+
+			if (appendToFile(location, batch.data(), batch.size())) {
+				for (const auto& it : m_changes) {
+					m_loaded[it.first] = it.second;
+				}
+				m_records = records;
+				m_changes.clear();
+				return true;
+			}
+		}
+		return compact(location);
+	}
+protected:
+	void load(const std::string& location) {
+		m_indexed = false;
+		m_mapping = std::make_shared<MappedFile>(location);
+		const MappedFile& file(*m_mapping);
+		if (!file || file.size() < HEADER_SIZE || memcmp(file.data(), "HEROIMAP", 8)) {
+			// There's either no index map yet, or one written as text by an older version
+			m_mapping.reset();
+			std::ifstream text(location, std::ios::in | std::ios::binary);
+			std::string line;
+			while (std::getline(text, line)) {
+				if (line.size() && line.back() == '\r') {
+					line.pop_back();
+				}
+				auto sep(line.find_first_of(','));
+				if (sep != std::string::npos) {
+					m_changes[line.substr(0, sep)] = IndexEntry(line.substr(sep + 1), FileStat());
+				}
+			}
+			recount();
+			return;
+		}
+
+		const char* data(file.data());
+		uint64_t version(getBigEndian(data + 8, 4));
+		uint64_t count(getBigEndian(data + 12, 4));
+		uint64_t pool(getBigEndian(data + 16, 4));
+		if (version < 1 || version > VERSION) {
+			std::cerr << "The index map was written by a newer version of hero, which this version cannot read.\n";
+			exit(1);
+		}
+		m_entrySize = entrySize(version);
+		if (count * m_entrySize + pool > file.size() - HEADER_SIZE) {
+			std::cerr << "The index map is truncated.\n";
+			std::cerr << "Please empty the index, and re-add the appropriate files.\n";
+			exit(1);
+		}
+
+		m_table = data + HEADER_SIZE;
+		m_pool = m_table + count * m_entrySize;
+		m_count = (size_t)count;
+		m_compact = (version != VERSION); // Records are only ever appended to a table of the current version
+
+		// Replay the changes recorded since the table was written
+		// Older versions had no commit records, so each of their records is its own batch.
+		size_t header(recordSize(version));
+		size_t position((size_t)(HEADER_SIZE + count * m_entrySize + pool));
+		size_t size((size_t)file.size());
+		size_t batch(position); // Where the batch being read started
+		std::vector<std::pair<Filename, IndexEntry>> pending;
+		while (position < size) {
+			if (version >= 3 && data[position] == 'C') {
+				if (size - position < COMMIT_SIZE || getBigEndian(data + position + 1, 4) != pending.size() || getBigEndian(data + position + 5, 4) != crc32(data + batch, position - batch)) {
+					break;
+				}
+				for (const auto& it : pending) {
+					m_loaded[it.first] = it.second;
+				}
+				m_records += pending.size();
+				pending.clear();
+				position += COMMIT_SIZE;
+				batch = position;
+				continue;
+			}
+
+			size_t length(size - position < header ? 0 : (size_t)getBigEndian(data + position + header - 4, 4));
+			if (size - position < header || length > size - position - header || (data[position] != 'S' && data[position] != 'E')) {
+				break;
+			}
+
+			IndexEntry entry;
+			if (data[position] == 'S') {
+				entry.hash = hexFromDigest(data + position + 1);
+				if (version >= 2) {
+					entry.stat = readStat(data + position + 33);
+				}
+			}
+			Filename path(data + position + header, length);
+			position += header + length;
+
+			if (version >= 3) {
+				pending.emplace_back(path, entry);
+			}
+			else {
+				m_loaded[path] = entry;
+				++m_records;
+				batch = position;
+			}
+		}
+
+		// A batch was cut short, or damaged: Rewrite the table to be rid of it
+		if (position < size || batch < size) {
+			m_compact = true;
+		}
+		recount();
+	}
+
+	// Counts the files in the table from the entries in the mapped table, and how the changes made since alter them
+	void recount() {
+		m_size = m_count;
+		for (const auto* overlay : { &m_loaded, &m_changes }) {
+			for (const auto& it : *overlay) {
+				// Whether the file was there before this change: Changes since loading apply on top of those recorded on disk
+				bool before;
+				auto loaded(overlay == &m_changes ? m_loaded.find(it.first) : m_loaded.end());
+				if (loaded != m_loaded.end()) {
+					before = loaded->second.hash.size() > 0;
+				}
+				else {
+					size_t i;
+					before = search(it.first, i);
+				}
+				bool after(it.second.hash.size() > 0);
+				m_size = m_size + after - before;
+			}
+		}
+	}
+
+	// Drops the mapping of the table, and with it every entry which hasn't been changed since it was loaded
+	void release() {
+		m_mapping.reset();
+		m_table = nullptr;
+		m_pool = nullptr;
+		m_count = 0;
+	}
+
+	// Writes every entry into a new table at location, replacing the old table and its records
+	bool compact(const std::string& location) {
+		// Gather the entries first: The table being replaced is where they're read from
+		std::string table, pool;
+		size_t count(0);
+		forEach([&table, &pool, &count](const Filename& path, const IndexEntry& entry) {
+			char bytes[40 + STAT_SIZE];
+			if (!digestFromHex(entry.hash, bytes)) {
+				memset(bytes, 0, 32);
+			}
+			putBigEndian(bytes + 32, pool.size(), 4);
+			putBigEndian(bytes + 36, path.size(), 4);
+			writeStat(bytes + 40, entry.stat);
+			table.append(bytes, sizeof(bytes));
+			pool += path;
+			++count;
+		});
+
+		char header[HEADER_SIZE];
+		memcpy(header, "HEROIMAP", 8);
+		putBigEndian(header + 8, VERSION, 4);
+		putBigEndian(header + 12, count, 4);
+		putBigEndian(header + 16, pool.size(), 4);
+
+		std::string partial(location + "_PARTIAL");
+		std::ofstream out(partial, std::ios::out | std::ios::binary | std::ios::trunc);
+		out.write(header, HEADER_SIZE);
+		out.write(table.data(), table.size());
+		out.write(pool.data(), pool.size());
+		out.close();
+		if (!out || !syncFile(partial)) { // The new table must be on disk before it replaces the old one
+			remove(partial.c_str());
+			return false;
+		}
+
+		// The old table must be unmapped before it can be replaced everywhere
+		release();
+		m_changes.clear();
+		m_loaded.clear();
+		m_records = 0;
+		bool renamed(replaceFile(partial, location));
+
+		// The new table holds the same entries, so the index by hash is still good
+		HashIndex index;
+		bool indexed(m_indexed);
+		index.swap(m_byHash);
+		load(renamed ? location : partial);
+		m_byHash.swap(index);
+		m_indexed = indexed;
+		return renamed && syncDirectory(parentDirectory(location));
+	}
+
+	// Removes the file at path from the index by hash, if the index has been built
+	void unindex(const Filename& path) {
+		IndexEntry current;
+		if (m_indexed && find(path, current)) {
+			m_byHash.erase(std::make_pair(current.hash, path));
+		}
+	}
+
+	static void writeRecord(std::string& out, const Filename& path, const IndexEntry& entry) {
+		char header[37 + STAT_SIZE];
+		header[0] = entry.hash.size() ? 'S' : 'E';
+		if (!digestFromHex(entry.hash, header + 1)) {
+			memset(header + 1, 0, 32);
+		}
+		writeStat(header + 33, entry.stat);
+		putBigEndian(header + 33 + STAT_SIZE, path.size(), 4);
+		out.append(header, sizeof(header));
+		out += path;
+	}
+
+	static FileStat readStat(const char* bytes) {
+		FileStat stat;
+		stat.mtime = getBigEndian(bytes);
+		stat.ctime = getBigEndian(bytes + 8);
+		stat.size = getBigEndian(bytes + 16);
+		stat.inode = getBigEndian(bytes + 24);
+		stat.device = getBigEndian(bytes + 32);
+		return stat;
+	}
+
+	static void writeStat(char* bytes, const FileStat& stat) {
+		putBigEndian(bytes, stat.mtime);
+		putBigEndian(bytes + 8, stat.ctime);
+		putBigEndian(bytes + 16, stat.size);
+		putBigEndian(bytes + 24, stat.inode);
+		putBigEndian(bytes + 32, stat.device);
+	}
+
+	IndexEntry tableEntry(size_t i) const {
+		const char* entry(m_table + i * m_entrySize);
+		return IndexEntry(hexFromDigest(entry), m_entrySize > 40 ? readStat(entry + 40) : FileStat());
+	}
+
+	const char* entryPath(size_t i) const {
+		return m_pool + getBigEndian(m_table + i * m_entrySize + 32, 4);
+	}
+
+	size_t entryLength(size_t i) const {
+		return (size_t)getBigEndian(m_table + i * m_entrySize + 36, 4);
+	}
+
+	// Orders path against the length bytes at other, as std::string would
+	static int compare(const Filename& path, const char* other, size_t length) {
+		int order(memcmp(path.data(), other, path.size() < length ? path.size() : length));
+		if (order) {
+			return order;
+		}
+		return path.size() < length ? -1 : path.size() > length ? 1 : 0;
+	}
+
+	// Binary searches the table for path, setting i to its entry if it's found
+	bool search(const Filename& path, size_t& i) const {
+		size_t low(0), high(m_count);
+		while (low < high) {
+			size_t middle(low + (high - low) / 2);
+			int order(compare(path, entryPath(middle), entryLength(middle)));
+			if (!order) {
+				i = middle;
+				return true;
+			}
+			else if (order < 0) {
+				high = middle;
+			}
+			else {
+				low = middle + 1;
+			}
+		}
+		return false;
+	}
+protected:
+	std::shared_ptr<MappedFile> m_mapping; // Shared between copies, which only ever read it
+	const char* m_table;
+	const char* m_pool;
+	size_t m_count;
+	size_t m_entrySize;
+
+	std::map<Filename, IndexEntry> m_loaded; // Changes recorded on disk after the table
+	std::map<Filename, IndexEntry> m_changes; // Changes made since loading, not yet saved
+	size_t m_records;
+	bool m_compact; // Whether the next save must write a whole new table
+	size_t m_size; // The number of files in the table
+
+	mutable HashIndex m_byHash;
+	mutable bool m_indexed; // Whether m_byHash holds every file in the table
+};
 
 class Commitmap;
 
+// Maps the filenames in the index to the hashes of their contents
+// Lookups and changes go straight to the underlying IndexTable. Iterating builds a sorted copy of the whole map, once per change.
+// Lookups by hash use the table's index by hash.
 class Indexmap {
 public:
 	using Filename = std::string;
 	using Hash = std::string;
 
-	using iterator = std::map<Filename, Hash>::iterator;
 	using const_iterator = std::map<Filename, Hash>::const_iterator;
+	using iterator = const_iterator; // Entries can only be changed through the map itself
 
-	Indexmap() {}
-	Indexmap(const Indexmap& map):m_map(map.m_map) {}
-	Indexmap(Indexmap&& map):m_map(std::move(map.m_map)) {}
+	Indexmap() : m_version(0), m_snapshotVersion(-1) {}
+	explicit Indexmap(const IndexTable& table) : m_table(table), m_version(0), m_snapshotVersion(-1) {}
 	Indexmap(const Commitmap& map);
-	
+
 	void add(const Filename& file) {
-		m_map[file] = picosha2::hash256_hex_string(std::ifstream(file));
+		(*this)[file] = hashOfFile(file);
 	}
 
 	Hash getHash(const Filename& file) const {
-		return m_map.at(file);
+		Hash hash;
+		m_table.find(file, hash);
+		return hash;
 	}
 
-	Filename getFile(const Hash& file) const {
-		for (const auto& it : m_map) {
-			if (it.second == file) {
-				return it.first;
-			}
-		}
-		return "";
+	// Sets entry to the hash and metadata recorded for file
+	// Returns whether file is in the map
+	bool getEntry(const Filename& file, IndexEntry& entry) const {
+		return m_table.find(file, entry);
 	}
 
-	iterator begin() noexcept {
-		return m_map.begin();
+	// Records the hash of file, along with the metadata it had when it was hashed
+	void set(const Filename& file, const Hash& hash, const FileStat& stat) {
+		++m_version;
+		m_table.set(file, hash, stat);
 	}
 
-	const_iterator begin() const noexcept {
-		return m_map.cbegin();
+	// Returns the first file, by path, with the given contents, or an empty string if there is none
+	Filename getFile(const Hash& file) const {
+		auto range(m_table.findHash(file));
+		return range.first == range.second ? "" : range.first->second;
 	}
 
-	const_iterator cbegin() const noexcept {
-		return m_map.cbegin();
+	const_iterator begin() const {
+		return snapshot().cbegin();
 	}
 
-	iterator end() noexcept {
-		return m_map.end();
+	const_iterator cbegin() const {
+		return snapshot().cbegin();
 	}
 
-	const_iterator end() const noexcept {
-		return m_map.cend();
+	const_iterator end() const {
+		return snapshot().cend();
 	}
 
-	const_iterator cend() const noexcept {
-		return m_map.cend();
+	const_iterator cend() const {
+		return snapshot().cend();
 	}
 
 	bool exists(const Filename& file) const {
-		return m_map.count(file) > 0;
+		return m_table.exists(file);
 	}
 
 	size_t size() const {
-		return m_map.size();
+		return m_table.size();
 	}
 
-	Hash& operator[] (const Filename& file) {
-		return m_map[file];
+	bool empty() const {
+		return m_table.empty();
 	}
 
-	const Hash& operator[] (const Filename& file) const {
-		return m_map.at(file);
+	Hash& operator[] (const Filename& file) {
+		++m_version;
+		return m_table.slot(file);
 	}
 
-	iterator erase(const_iterator position) {
-		m_map.erase(position);
+	Hash operator[] (const Filename& file) const {
+		return getHash(file);
 	}
 
 	size_t erase(const Filename& value) {
-		m_map.erase(value);
+		if (!exists(value)) {
+			return 0;
+		}
+		++m_version;
+		m_table.erase(value);
+		return 1;
 	}
 
-	iterator erase(const_iterator first, const_iterator last) {
-		m_map.erase(first, last);
+	void clear() {
+		++m_version;
+		m_table.clear();
 	}
 
-	void clear() noexcept {
-		m_map.clear();
+	const IndexTable& table() const {
+		return m_table;
+	}
+
+	// Writes the map to file, in the binary format
+	bool save(const std::string& file) {
+		return m_table.save(file);
 	}
 
 	static Indexmap loadFrom(std::istream& stream) {
@@ -108,16 +652,18 @@ public:
 		return result;
 	}
 
+	// Loads the map stored at file, in either format
 	static Indexmap loadFrom(const std::string& file) {
-		return loadFrom(std::ifstream(file));
+		return Indexmap(IndexTable(file));
 	}
 
 	static Indexmap loadFrom(const char* file) {
-		return loadFrom(std::ifstream(file));
+		return loadFrom(std::string(file));
 	}
 
+	// The text format, as written by older versions
 	friend std::ostream& operator << (std::ostream& stream, const Indexmap& map) {
-		for (const auto& it : map.m_map) {
+		for (const auto& it : map) {
 			stream << it.first << ',' << it.second << '\n';
 		}
 		return stream;
@@ -131,103 +677,121 @@ public:
 			auto sep(buffer.find_first_of(','));
 			first = buffer.substr(0, sep);
 			second = buffer.substr(sep + 1);
-			map.m_map[first] = second;
+			map[first] = second;
 			std::getline(stream, buffer);
 		}
 		return stream;
 	}
 protected:
-	std::map<Filename, Hash> m_map;
+	const std::map<Filename, Hash>& snapshot() const {
+		if (m_snapshotVersion != m_version) {
+			m_snapshot.clear();
+			m_table.forEach([this](const Filename& path, const IndexEntry& entry) {
+				m_snapshot.emplace_hint(m_snapshot.end(), path, entry.hash);
+			});
+			m_snapshotVersion = m_version;
+		}
+		return m_snapshot;
+	}
+protected:
+	IndexTable m_table;
+	long m_version; // Counts changes, so the snapshot knows when it's stale
+	mutable std::map<Filename, Hash> m_snapshot;
+	mutable long m_snapshotVersion;
 };
 
+// Maps the hashes of the contents in the index to the filenames which hold them
+// Several files may have the same contents, so a hash may map to several filenames: Iterating visits every (hash, filename) pair.
+// Lookups in either direction go to the underlying IndexTable, which keeps an index by hash alongside its table by path.
 class Commitmap {
 public:
 	using Filename = std::string;
 	using Hash = std::string;
 
-	using iterator = std::map<Filename, Hash>::iterator;
-	using const_iterator = std::map<Filename, Hash>::const_iterator;
+	using const_iterator = IndexTable::HashIndex::const_iterator;
+	using iterator = const_iterator; // Entries can only be changed through the map itself
 
 	Commitmap() {}
-	Commitmap(const Commitmap& map) :m_map(map.m_map) {}
-	Commitmap(Commitmap&& map) :m_map(std::move(map.m_map)) {}
-	Commitmap(const Indexmap& map) {
-		for (const auto& it : map) {
-			m_map[it.second] = it.first;
-		}
-	}
+	explicit Commitmap(const IndexTable& table) : m_table(table) {}
+	Commitmap(const Indexmap& map) : m_table(map.table()) {}
 
 	void add(const Filename& file) {
-		m_map[picosha2::hash256_hex_string(std::ifstream(file))] = file;
+		m_table.set(file, hashOfFile(file));
 	}
 
 	Hash getHash(const Filename& file) const {
-		for (const auto& it : m_map) {
-			if (it.second == file) {
-				return it.first;
-			}
-		}
-		return "";
+		Hash hash;
+		m_table.find(file, hash);
+		return hash;
 	}
 
+	// Returns the first file, by path, with the given contents, or an empty string if there is none
 	Filename getFile(const Hash& file) const {
-		return m_map.at(file);
-	}
-
-	iterator begin() noexcept {
-		return m_map.begin();
+		auto range(m_table.findHash(file));
+		return range.first == range.second ? "" : range.first->second;
 	}
 
-	const_iterator begin() const noexcept {
-		return m_map.cbegin();
+	// Returns every file with the given contents, in order of path
+	std::vector<Filename> getFiles(const Hash& file) const {
+		std::vector<Filename> files;
+		auto range(m_table.findHash(file));
+		for (auto it = range.first; it != range.second; ++it) {
+			files.push_back(it->second);
+		}
+		return files;
 	}
 
-	const_iterator cbegin() const noexcept {
-		return m_map.cbegin();
+	const_iterator begin() const {
+		return m_table.byHash().cbegin();
 	}
 
-	iterator end() noexcept {
-		return m_map.end();
+	const_iterator cbegin() const {
+		return m_table.byHash().cbegin();
 	}
 
-	const_iterator end() const noexcept {
-		return m_map.cend();
+	const_iterator end() const {
+		return m_table.byHash().cend();
 	}
 
-	const_iterator cend() const noexcept {
-		return m_map.cend();
+	const_iterator cend() const {
+		return m_table.byHash().cend();
 	}
 
 	bool exists(const Hash& file) const {
-		return m_map.count(file) > 0;
+		auto range(m_table.findHash(file));
+		return range.first != range.second;
 	}
 
+	// The number of files in the map, counting each file with duplicated contents
 	size_t size() const {
-		return m_map.size();
+		return m_table.size();
 	}
 
-	Filename& operator[] (const Hash& file) {
-		return m_map[file];
+	Filename operator[] (const Hash& file) const {
+		return getFile(file);
 	}
 
-	const Filename& operator[] (const Hash& file) const {
-		return m_map.at(file);
-	}
-
-	iterator erase(const_iterator position) {
-		m_map.erase(position);
+	// Removes every file with the given contents
+	// Returns the number of files removed
+	size_t erase(const Hash& value) {
+		std::vector<Filename> files(getFiles(value));
+		for (const auto& file : files) {
+			m_table.erase(file);
+		}
+		return files.size();
 	}
 
-	size_t erase(const Hash& value) {
-		m_map.erase(value);
+	void clear() {
+		m_table.clear();
 	}
 
-	iterator erase(const_iterator first, const_iterator last) {
-		m_map.erase(first, last);
+	const IndexTable& table() const {
+		return m_table;
 	}
 
-	void clear() noexcept {
-		m_map.clear();
+	// Writes the map to file, in the binary format
+	bool save(const std::string& file) {
+		return m_table.save(file);
 	}
 
 	static Commitmap loadFrom(std::istream& stream) {
@@ -238,16 +802,18 @@ public:
 		return result;
 	}
 
+	// Loads the map stored at file, in either format
 	static Commitmap loadFrom(const std::string& file) {
-		return loadFrom(std::ifstream(file));
+		return Commitmap(IndexTable(file));
 	}
 
 	static Commitmap loadFrom(const char* file) {
-		return loadFrom(std::ifstream(file));
+		return loadFrom(std::string(file));
 	}
 
+	// The text format, as written by older versions
 	friend std::ostream& operator << (std::ostream& stream, const Commitmap& map) {
-		for (const auto& it : map.m_map) {
+		for (const auto& it : map) {
 			stream << it.second << ',' << it.first << '\n';
 		}
 		return stream;
@@ -261,20 +827,16 @@ public:
 			auto sep(buffer.find_first_of(','));
 			first = buffer.substr(0, sep);
 			second = buffer.substr(sep + 1);
-			map.m_map[second] = first;
+			map.m_table.set(first, second);
 			std::getline(stream, buffer);
 		}
 		return stream;
 	}
 protected:
-	std::map<Hash, Filename> m_map;
+	IndexTable m_table;
 };
 
-Indexmap::Indexmap(const Commitmap& map) {
-	for (const auto& it : map) {
-		m_map[it.second] = it.first;
-	}
-}
+Indexmap::Indexmap(const Commitmap& map) : m_table(map.table()), m_version(0), m_snapshotVersion(-1) {}
 
 // A class which handles automatically loading and writing the indexmap in the chosen format
 // The contained Indexmap is automatically loaded from disk when its constructed, and written to disk when the loader goes out of scope.
@@ -303,9 +865,7 @@ public:
 	void write() {
 		if (!m_location.size()) return; // Do not attempt sync to empty strings
 
-		std::ofstream target(m_location, std::ios::out | std::ios::trunc);
-		target << map;
-		target.close();
+		map.save(m_location);
 	}
 protected:
 	std::string m_location;
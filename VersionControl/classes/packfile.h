@@ -0,0 +1,578 @@
+// packfile.h: Defines the classes which write and read packfiles, and the binary delta encoding used inside them
+// The formats are specified in pack-file.txt.
+
+#ifndef PACKFILE_H
+#define PACKFILE_H
+#pragma once
+
+#include "hero.h"
+#include "crossplatform.h"
+#include "compression.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+namespace delta {
+	const size_t BLOCK_SIZE = 16; // Length of the runs which are looked up in the base. Shorter matches are inserted literally.
+	const uint64_t MULTIPLIER = 0x100000001b3ULL; // For the rolling hash of each run
+
+	// Appends value to out in 7-bit groups, least significant first, with the top bit set on all but the last
+	void putVarint(std::string& out, uint64_t value) {
+		while (value >= 0x80) {
+			out += (char)((value & 0x7f) | 0x80);
+			value >>= 7;
+		}
+		out += (char)value;
+	}
+
+	// Reads a value written by putVarint from data, advancing position
+	// Returns false if the value runs past end
+	bool getVarint(const char* data, size_t end, size_t& position, uint64_t& value) {
+		value = 0;
+		for (unsigned shift = 0; position < end && shift < 64; shift += 7) {
+			unsigned char byte((unsigned char)data[position++]);
+			value |= (uint64_t)(byte & 0x7f) << shift;
+			if (!(byte & 0x80)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// The hash of the BLOCK_SIZE bytes at data
+	uint64_t blockHash(const char* data) {
+		uint64_t hash(0);
+		for (size_t i = 0; i < BLOCK_SIZE; ++i) {
+			hash = hash * MULTIPLIER + (unsigned char)data[i];
+		}
+		return hash;
+	}
+
+	// Encodes target as a series of copies from base and literal insertions, into out
+	// Every aligned block of the base is indexed, then a rolling hash finds blocks of the target which match one.
+	// Matches are extended in both directions as far as the bytes agree.
+	// Gives up and returns false as soon as the delta would be larger than limit bytes
+	bool encode(const char* base, size_t baseSize, const char* target, size_t targetSize, size_t limit, std::string& out) {
+		out.clear();
+		putVarint(out, baseSize);
+		putVarint(out, targetSize);
+
+		std::unordered_map<uint64_t, size_t> blocks; // Maps the hash of a block of the base to its first offset
+		blocks.reserve(baseSize / BLOCK_SIZE + 1);
+		for (size_t offset = 0; offset + BLOCK_SIZE <= baseSize; offset += BLOCK_SIZE) {
+			blocks.emplace(blockHash(base + offset), offset);
+		}
+
+		// The factor which removes the oldest byte from the rolling hash
+		uint64_t outgoing(1);
+		for (size_t i = 1; i < BLOCK_SIZE; ++i) {
+			outgoing *= MULTIPLIER;
+		}
+
+		size_t literal(0); // Start of the bytes which have not been encoded yet
+		size_t position(0);
+		uint64_t hash(targetSize >= BLOCK_SIZE ? blockHash(target) : 0);
+		while (position + BLOCK_SIZE <= targetSize) {
+			auto match(blocks.find(hash));
+			if (match != blocks.end() && !memcmp(base + match->second, target + position, BLOCK_SIZE)) {
+				// Grow the match backwards over pending literals, then forwards
+				size_t from(match->second);
+				size_t start(position);
+				while (start > literal && from > 0 && base[from - 1] == target[start - 1]) {
+					--from;
+					--start;
+				}
+				size_t length(position - start + BLOCK_SIZE);
+				while (from + length < baseSize && start + length < targetSize && base[from + length] == target[start + length]) {
+					++length;
+				}
+
+				if (start > literal) {
+					out += '\0';
+					putVarint(out, start - literal);
+					out.append(target + literal, start - literal);
+				}
+				out += '\1';
+				putVarint(out, from);
+				putVarint(out, length);
+				if (out.size() > limit) {
+					return false;
+				}
+
+				position = literal = start + length;
+				if (position + BLOCK_SIZE <= targetSize) {
+					hash = blockHash(target + position);
+				}
+				continue;
+			}
+
+			if (position + BLOCK_SIZE < targetSize) {
+				hash = (hash - outgoing * (unsigned char)target[position]) * MULTIPLIER + (unsigned char)target[position + BLOCK_SIZE];
+			}
+			++position;
+
+			// Literals are only flushed alongside a copy, so check they alone haven't blown the budget
+			if (out.size() + (position - literal) > limit) {
+				return false;
+			}
+		}
+
+		if (literal < targetSize) {
+			out += '\0';
+			putVarint(out, targetSize - literal);
+			out.append(target + literal, targetSize - literal);
+		}
+		return out.size() <= limit;
+	}
+
+	// Rebuilds the target which delta was encoded from, using base, into out
+	// Returns false if the delta is malformed, or was not made against a base of this size
+	bool apply(const char* base, size_t baseSize, const char* delta, size_t deltaSize, std::string& out) {
+		size_t position(0);
+		uint64_t expectedBase, targetSize;
+		if (!getVarint(delta, deltaSize, position, expectedBase) || !getVarint(delta, deltaSize, position, targetSize) || expectedBase != baseSize) {
+			return false;
+		}
+
+		out.clear();
+		out.reserve(targetSize);
+		while (position < deltaSize) {
+			char op(delta[position++]);
+			uint64_t offset, length;
+			if (op == '\0') {
+				if (!getVarint(delta, deltaSize, position, length) || length > deltaSize - position) {
+					return false;
+				}
+				out.append(delta + position, length);
+				position += length;
+			}
+			else if (op == '\1') {
+				if (!getVarint(delta, deltaSize, position, offset) || !getVarint(delta, deltaSize, position, length) || offset > baseSize || length > baseSize - offset) {
+					return false;
+				}
+				out.append(base + offset, length);
+			}
+			else {
+				return false;
+			}
+
+			if (out.size() > targetSize) {
+				return false;
+			}
+		}
+		return out.size() == targetSize;
+	}
+}
+
+namespace packfile {
+	const std::string MAGIC("HERO PACK\n");
+	const char INDEX_MAGIC[8] = { 'H', 'E', 'R', 'O', 'I', 'D', 'X', '\1' };
+	const size_t FANOUT_SIZE = 256 * 4;
+	const size_t INDEX_ENTRY_SIZE = 32 + 8 + 8; // Raw hash, offset, size
+	const char WHOLE = 'W';
+	const char DELTA = 'D';
+	const char COMPRESSED = 'Z';
+
+	const size_t WINDOW = 10; // How many of the objects written just before each object are tried as its delta base
+	const size_t MAX_CHAIN = 10; // The longest chain of deltas written, so reading an object never has to apply more than this many
+	const uint64_t MAX_DELTA_SIZE = 16 << 20; // Larger objects are always stored whole, so we never hold several of them in memory
+}
+
+// Writes a packfile and its index into the packs directory
+// Objects are added one at a time, either whole or as a delta against an object added earlier.
+// Like CommitWriter, the pack is written under a temporary name and hashed as it goes, then renamed to its hash by finish().
+// Cannot be copied.
+class PackWriter {
+public:
+	PackWriter() : m_directory(repositoryPath("packs").asStdString()), m_location(m_directory + "/PACK_PARTIAL"), m_written(0), m_finished(false) {
+		m_file.open(m_location, std::ios::out | std::ios::binary | std::ios::trunc);
+	}
+
+	~PackWriter() {
+		if (!m_finished) {
+			m_file.close();
+			remove(m_location.c_str());
+		}
+	}
+
+	explicit operator bool() const {
+		return !m_finished && bool(m_file);
+	}
+
+	// Writes the pack header, which must come before any object
+	void begin(size_t count) {
+		write(packfile::MAGIC);
+		write("version 1\ncount " + std::to_string(count) + "\n&&&&&\n");
+	}
+
+	// Stores the object with the given hash as it is
+	// Returns the offset of the object in the pack, for later deltas to refer to
+	uint64_t addWhole(const std::string& hash, const char* data, uint64_t size) {
+		return add(hash, packfile::WHOLE, data, size, size, 0);
+	}
+
+	// Stores the object with the given hash, of the given size, as a single LZ4 block
+	uint64_t addCompressed(const std::string& hash, const std::string& block, uint64_t size) {
+		return add(hash, packfile::COMPRESSED, block.data(), block.size(), size, 0);
+	}
+
+	// Stores the object with the given hash, of the given size, as a delta against the object at base
+	uint64_t addDelta(const std::string& hash, const std::string& delta, uint64_t size, uint64_t base) {
+		return add(hash, packfile::DELTA, delta.data(), delta.size(), size, base);
+	}
+
+	// Completes the pack, and moves it and its index to their final locations
+	// Returns the name of the pack (without an extension), or an empty string if it could not be written
+	std::string finish() {
+		if (!*this) {
+			return "";
+		}
+		m_file.close();
+		if (!m_file) {
+			return "";
+		}
+
+		std::string name("pack-" + m_hasher.hexDigest());
+		std::string target(m_directory + "/" + name);
+
+		// The index is written last: A pack without one is never read
+		// Both are on disk before finish() returns, since whatever the pack replaces is removed once it has been verified.
+		std::string index(target + ".idx");
+		std::string indexPartial(m_directory + "/INDEX_PARTIAL");
+		remove(index.c_str());
+		if (!syncFile(m_location) || !replaceFile(m_location, target + ".pack")) {
+			return "";
+		}
+		m_finished = true;
+
+		if (!writeIndex(indexPartial) || !syncFile(indexPartial) || !replaceFile(indexPartial, index) || !syncDirectory(m_directory)) {
+			remove(indexPartial.c_str());
+			remove(index.c_str());
+			remove((target + ".pack").c_str());
+			return "";
+		}
+		return name;
+	}
+protected:
+	struct Entry {
+		char hash[32];
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	void write(const char* data, size_t size) {
+		m_file.write(data, size);
+		m_hasher.update(data, size);
+		m_written += size;
+	}
+
+	void write(const std::string& data) {
+		write(data.data(), data.size());
+	}
+
+	uint64_t add(const std::string& hash, char type, const char* data, uint64_t stored, uint64_t size, uint64_t base) {
+		Entry entry;
+		if (!digestFromHex(hash, entry.hash)) {
+			m_file.setstate(std::ios::failbit); // Poison the pack, so finish() fails
+			return 0;
+		}
+		entry.offset = m_written;
+		entry.size = size;
+		m_entries.push_back(entry);
+
+		std::string header(1, type);
+		delta::putVarint(header, stored);
+		if (type == packfile::DELTA) {
+			delta::putVarint(header, base);
+		}
+		else if (type == packfile::COMPRESSED) {
+			delta::putVarint(header, size);
+		}
+		write(header);
+		write(data, stored);
+		return entry.offset;
+	}
+
+	// Writes the index: A fanout table by the first byte of each hash, then every entry sorted by hash
+	bool writeIndex(const std::string& location) {
+		std::sort(m_entries.begin(), m_entries.end(), [](const Entry& a, const Entry& b) {
+			return memcmp(a.hash, b.hash, 32) < 0;
+		});
+
+		std::ofstream out(location, std::ios::out | std::ios::binary | std::ios::trunc);
+		out.write(packfile::INDEX_MAGIC, sizeof(packfile::INDEX_MAGIC));
+
+		char buffer[packfile::INDEX_ENTRY_SIZE];
+		size_t entry(0);
+		for (unsigned first = 0; first < 256; ++first) {
+			while (entry < m_entries.size() && (unsigned char)m_entries[entry].hash[0] <= first) {
+				++entry;
+			}
+			putBigEndian(buffer, entry, 4); // The number of entries whose hash begins with first or less
+			out.write(buffer, 4);
+		}
+
+		for (const auto& it : m_entries) {
+			memcpy(buffer, it.hash, 32);
+			putBigEndian(buffer + 32, it.offset);
+			putBigEndian(buffer + 40, it.size);
+			out.write(buffer, sizeof(buffer));
+		}
+		out.close();
+		return bool(out);
+	}
+protected:
+	std::string m_directory;
+	std::string m_location;
+	std::ofstream m_file;
+	Hasher m_hasher;
+	std::vector<Entry> m_entries;
+	uint64_t m_written;
+	bool m_finished;
+
+private:
+	PackWriter(const PackWriter&);
+};
+
+// Reads objects out of a single packfile, through a mapping of it and of its index
+// Lookups binary search the part of the index the fanout table selects, so finding an object takes O(log n).
+// Every method is const, and only reads the mappings, so one reader may be shared between threads.
+// Cannot be copied.
+class PackReader {
+public:
+	static const size_t MAX_DEPTH = 50; // Deltas refer back no further than this. Deeper chains are treated as corrupt.
+
+	// name is the name of the pack in the packs directory, without an extension
+	explicit PackReader(const std::string& name) : m_name(name), m_pack(repositoryPath("packs/" + name + ".pack").asStdString()), m_index(repositoryPath("packs/" + name + ".idx").asStdString()), m_count(0), m_good(false) {
+		if (!m_pack || !m_index || m_pack.size() < packfile::MAGIC.size() || memcmp(m_pack.data(), packfile::MAGIC.data(), packfile::MAGIC.size())) {
+			return;
+		}
+		if (m_index.size() < sizeof(packfile::INDEX_MAGIC) + packfile::FANOUT_SIZE || memcmp(m_index.data(), packfile::INDEX_MAGIC, sizeof(packfile::INDEX_MAGIC))) {
+			return;
+		}
+
+		uint64_t count(getBigEndian(fanout() + 255 * 4, 4));
+		if (m_index.size() != sizeof(packfile::INDEX_MAGIC) + packfile::FANOUT_SIZE + count * packfile::INDEX_ENTRY_SIZE) {
+			return;
+		}
+		m_count = (size_t)count;
+		m_good = true;
+	}
+
+	explicit operator bool() const {
+		return m_good;
+	}
+
+	const std::string& name() const {
+		return m_name;
+	}
+
+	// The number of objects in the pack
+	size_t count() const {
+		return m_count;
+	}
+
+	// The hash of the i'th object, in sorted order
+	std::string hashAt(size_t i) const {
+		return hexFromDigest(entry(i));
+	}
+
+	// Returns whether the pack holds the object with the given hash, and if so, sets size to its size
+	bool find(const std::string& hash, uint64_t& size) const {
+		const char* found(lookup(hash));
+		if (!found) {
+			return false;
+		}
+		size = getBigEndian(found + 40);
+		return true;
+	}
+
+	bool contains(const std::string& hash) const {
+		uint64_t size;
+		return find(hash, size);
+	}
+
+	// Finds the contents of the object with the given hash
+	// If it is stored whole, data points straight into the mapped pack. Otherwise, it is rebuilt into scratch, and data points there.
+	// Returns false if the pack does not hold the object, or it could not be rebuilt
+	bool view(const std::string& hash, const char*& data, uint64_t& size, std::string& scratch) const {
+		const char* found(lookup(hash));
+		if (!found) {
+			return false;
+		}
+		return read(getBigEndian(found + 32), data, size, scratch, 0);
+	}
+protected:
+	const char* fanout() const {
+		return m_index.data() + sizeof(packfile::INDEX_MAGIC);
+	}
+
+	const char* entry(size_t i) const {
+		return fanout() + packfile::FANOUT_SIZE + i * packfile::INDEX_ENTRY_SIZE;
+	}
+
+	// Returns the index entry for hash, or nullptr if there is none
+	const char* lookup(const std::string& hash) const {
+		char raw[32];
+		if (!m_count || !digestFromHex(hash, raw)) {
+			return nullptr;
+		}
+
+		unsigned char first((unsigned char)raw[0]);
+		size_t low(first ? (size_t)getBigEndian(fanout() + (first - 1) * 4, 4) : 0);
+		size_t high((size_t)getBigEndian(fanout() + first * 4, 4));
+		while (low < high) {
+			size_t middle(low + (high - low) / 2);
+			int order(memcmp(entry(middle), raw, 32));
+			if (!order) {
+				return entry(middle);
+			}
+			else if (order < 0) {
+				low = middle + 1;
+			}
+			else {
+				high = middle;
+			}
+		}
+		return nullptr;
+	}
+
+	// Reads the object stored at offset, decompressing it or resolving deltas against their bases first
+	bool read(uint64_t offset, const char*& data, uint64_t& size, std::string& scratch, size_t depth) const {
+		if (depth > MAX_DEPTH || offset >= m_pack.size()) {
+			return false;
+		}
+
+		size_t position((size_t)offset + 1);
+		uint64_t stored, base(0), original(0);
+		char type(m_pack.data()[offset]);
+		if (!delta::getVarint(m_pack.data(), (size_t)m_pack.size(), position, stored)) {
+			return false;
+		}
+		if (type == packfile::DELTA && (!delta::getVarint(m_pack.data(), (size_t)m_pack.size(), position, base) || base >= offset)) {
+			return false;
+		}
+		if (type == packfile::COMPRESSED && !delta::getVarint(m_pack.data(), (size_t)m_pack.size(), position, original)) {
+			return false;
+		}
+		if (stored > m_pack.size() - position) {
+			return false;
+		}
+
+		if (type == packfile::WHOLE) {
+			data = m_pack.data() + position;
+			size = stored;
+			return true;
+		}
+		else if (type == packfile::COMPRESSED) {
+			scratch.resize((size_t)original);
+			if (!lz4::decompress(m_pack.data() + position, (size_t)stored, &scratch[0], scratch.size())) {
+				return false;
+			}
+			data = scratch.data();
+			size = scratch.size();
+			return true;
+		}
+		else if (type != packfile::DELTA) {
+			return false;
+		}
+
+		const char* baseData;
+		uint64_t baseSize;
+		std::string baseScratch;
+		if (!read(base, baseData, baseSize, baseScratch, depth + 1)) {
+			return false;
+		}
+		if (!delta::apply(baseData, (size_t)baseSize, m_pack.data() + position, (size_t)stored, scratch)) {
+			return false;
+		}
+		data = scratch.data();
+		size = scratch.size();
+		return true;
+	}
+protected:
+	std::string m_name;
+	MappedFile m_pack;
+	MappedFile m_index;
+	size_t m_count;
+	bool m_good;
+
+private:
+	PackReader(const PackReader&);
+};
+
+// Every pack in the repository, searched in turn for objects which aren't stored loose in the objects directory
+// Loose objects may be stored unmodified, or compressed.
+// Cannot be copied.
+class PackSet {
+public:
+	PackSet() {
+		std::vector<std::string> names;
+		if (filesInDirectory(repositoryPath("packs"), names)) {
+			return; // Repositories which have never been packed have no packs directory
+		}
+
+		for (const auto& name : names) {
+			const std::string extension(".idx");
+			if (name.size() > extension.size() && !name.compare(name.size() - extension.size(), extension.size(), extension)) {
+				std::unique_ptr<PackReader> reader(new PackReader(name.substr(0, name.size() - extension.size())));
+				if (*reader) {
+					m_packs.push_back(std::move(reader));
+				}
+			}
+		}
+	}
+
+	const std::vector<std::unique_ptr<PackReader>>& packs() const {
+		return m_packs;
+	}
+
+	// Returns the pack holding the object with the given hash, or nullptr if no pack holds it
+	const PackReader* find(const std::string& hash) const {
+		for (const auto& pack : m_packs) {
+			if (pack->contains(hash)) {
+				return pack.get();
+			}
+		}
+		return nullptr;
+	}
+
+	// Returns whether the object with the given hash exists, either loose or in a pack
+	bool hasObject(const std::string& hash) const {
+		return std::ifstream(objectPath(hash)) || std::ifstream(objectPath(hash, encoding::LZ4)) || find(hash);
+	}
+
+	// Sets size to the size of the contents of the object with the given hash, looking at loose objects first
+	// Returns false if the object doesn't exist
+	bool objectSize(const std::string& hash, uint64_t& size) const {
+		std::ifstream loose(objectPath(hash), std::ios::binary | std::ios::ate);
+		if (loose) {
+			size = loose.tellg();
+			return true;
+		}
+		std::ifstream compressed(objectPath(hash, encoding::LZ4), std::ios::binary);
+		uint64_t blockSize;
+		if (compressed && encoding::readHeader(compressed, size, blockSize)) {
+			return true;
+		}
+		for (const auto& pack : m_packs) {
+			if (pack->find(hash, size)) {
+				return true;
+			}
+		}
+		return false;
+	}
+protected:
+	std::vector<std::unique_ptr<PackReader>> m_packs;
+
+private:
+	PackSet(const PackSet&);
+};
+#endif // !PACKFILE_H
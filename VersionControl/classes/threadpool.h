@@ -0,0 +1,147 @@
+// threadpool.h: Defines the ThreadPool class, a small work-stealing pool for running independent tasks concurrently
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <deque>
+#include <vector>
+
+// Each worker owns a queue of tasks. Submitted tasks are dealt out to the queues in turn.
+// A worker takes tasks from the front of its own queue, and when that runs dry, steals from the back of the others.
+// A pool made with one thread (or fewer) doesn't start any threads at all: Tasks are run immediately by submit().
+// The destructor waits for every submitted task to finish.
+// Cannot be copied.
+class ThreadPool {
+public:
+	using Task = std::function<void()>;
+
+	explicit ThreadPool(size_t threads) : m_queued(0), m_stopping(false), m_next(0) {
+		if (threads <= 1) {
+			return;
+		}
+
+		for (size_t i = 0; i < threads; ++i) {
+			m_queues.emplace_back(new Queue);
+		}
+		for (size_t i = 0; i < threads; ++i) {
+			m_threads.emplace_back(&ThreadPool::run, this, i);
+		}
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_stopping = true;
+		}
+		m_wake.notify_all();
+		for (auto& thread : m_threads) {
+			thread.join();
+		}
+	}
+
+	// Returns the number of threads the hardware can run at once, or 1 if that isn't known
+	static size_t hardwareThreads() {
+		size_t threads(std::thread::hardware_concurrency());
+		return threads ? threads : 1;
+	}
+
+	size_t size() const {
+		return m_threads.size();
+	}
+
+	// Queues f to be run by the pool, and returns a future for its result
+	template <class F> auto submit(F f) -> std::future<decltype(f())> {
+		using Result = decltype(f());
+		auto task(std::make_shared<std::packaged_task<Result()>>(std::move(f)));
+		std::future<Result> result(task->get_future());
+
+		if (m_threads.empty()) {
+			(*task)();
+			return result;
+		}
+
+		Queue& queue(*m_queues[m_next++ % m_queues.size()]);
+		{
+			std::lock_guard<std::mutex> guard(queue.lock);
+			queue.tasks.emplace_back([task]() { (*task)(); });
+		}
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			++m_queued;
+		}
+		m_wake.notify_one();
+		return result;
+	}
+protected:
+	struct Queue {
+		std::mutex lock;
+		std::deque<Task> tasks;
+	};
+
+	// Takes a task from the front of the worker's own queue, or failing that, from the back of another's
+	// Returns whether a task was found
+	bool take(size_t self, Task& task) {
+		for (size_t i = 0; i < m_queues.size(); ++i) {
+			Queue& queue(*m_queues[(self + i) % m_queues.size()]);
+			std::lock_guard<std::mutex> guard(queue.lock);
+			if (queue.tasks.empty()) {
+				continue;
+			}
+
+			if (!i) {
+				task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+			}
+			else {
+				task = std::move(queue.tasks.back());
+				queue.tasks.pop_back();
+			}
+			return true;
+		}
+		return false;
+	}
+
+	// The body of each worker thread
+	void run(size_t self) {
+		Task task;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> guard(m_lock);
+				m_wake.wait(guard, [this]() { return m_queued || m_stopping; });
+				if (!m_queued && m_stopping) {
+					return;
+				}
+			}
+
+			if (take(self, task)) {
+				{
+					std::lock_guard<std::mutex> guard(m_lock);
+					--m_queued;
+				}
+				task();
+			}
+			else {
+				std::this_thread::yield(); // Another worker got there first
+			}
+		}
+	}
+protected:
+	std::vector<std::unique_ptr<Queue>> m_queues;
+	std::vector<std::thread> m_threads;
+	std::mutex m_lock;
+	std::condition_variable m_wake;
+	size_t m_queued;
+	bool m_stopping;
+	size_t m_next;
+
+private:
+	ThreadPool(const ThreadPool&);
+};
+#endif // !THREADPOOL_H
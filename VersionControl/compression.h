@@ -0,0 +1,341 @@
+// compression.h: A compressor and decompressor for the LZ4 block format, and the framing used for compressed objects
+// The block format is the one documented by the LZ4 project, so blocks written here can be read by the reference library and vice versa.
+// The framing is our own, and is specified in commit-blob.txt.
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+#pragma once
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <ostream>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <cstdlib>
+#include <cctype>
+#include <cerrno>
+
+namespace lz4 {
+	const size_t MIN_MATCH = 4; // The shortest match the format can express
+	const size_t LAST_LITERALS = 5; // The last five bytes of a block are always literals
+	const size_t MATCH_LIMIT = 12; // And no match may start in the last twelve
+	const size_t MAX_DISTANCE = 65535; // Offsets are 16 bits
+	const size_t HASH_BITS = 16;
+	const int MAX_LEVEL = 9;
+
+	// The largest a block of size bytes could possibly compress to
+	size_t compressBound(size_t size) {
+		return size + size / 255 + 16;
+	}
+
+	uint32_t read32(const char* p) {
+		uint32_t value;
+		memcpy(&value, p, sizeof(value));
+		return value;
+	}
+
+	uint32_t hash4(const char* p) {
+		return (read32(p) * 2654435761u) >> (32 - HASH_BITS);
+	}
+
+	// Writes the part of a length which doesn't fit in a token nibble, as a run of 255s and a remainder
+	void putLength(std::string& out, size_t length) {
+		for (; length >= 255; length -= 255) {
+			out += (char)255;
+		}
+		out += (char)length;
+	}
+
+	// Compresses size bytes from source into out, as a single LZ4 block
+	// level runs from 1 to MAX_LEVEL: Each level doubles the number of earlier positions tried for each match.
+	void compress(const char* source, size_t size, std::string& out, int level) {
+		out.clear();
+		out.reserve(compressBound(size));
+
+		size_t attempts((size_t)1 << ((level < 1 ? 1 : level > MAX_LEVEL ? MAX_LEVEL : level) - 1));
+		std::vector<int64_t> head((size_t)1 << HASH_BITS, -1); // The last position with each hash
+		std::vector<int64_t> chain(MAX_DISTANCE + 1, -1); // The position before each one with the same hash
+
+		size_t anchor(0); // Start of the literals waiting to be written
+		size_t position(0);
+		while (size > MATCH_LIMIT && position <= size - MATCH_LIMIT) {
+			uint32_t hash(hash4(source + position));
+			size_t bestLength(0), bestDistance(0);
+
+			int64_t candidate(head[hash]);
+			for (size_t i = 0; i < attempts && candidate >= 0 && position - (size_t)candidate <= MAX_DISTANCE; ++i) {
+				if (read32(source + candidate) == read32(source + position)) {
+					size_t length(MIN_MATCH);
+					while (position + length < size - LAST_LITERALS && source[candidate + length] == source[position + length]) {
+						++length;
+					}
+					if (length > bestLength) {
+						bestLength = length;
+						bestDistance = position - (size_t)candidate;
+					}
+				}
+				candidate = chain[(size_t)candidate & MAX_DISTANCE];
+			}
+			chain[position & MAX_DISTANCE] = head[hash];
+			head[hash] = position;
+
+			if (bestLength < MIN_MATCH) {
+				++position;
+				continue;
+			}
+
+			// Write the sequence: A token, the literals since the last match, then the match
+			size_t literals(position - anchor);
+			size_t extra(bestLength - MIN_MATCH);
+			out += (char)(((literals < 15 ? literals : 15) << 4) | (extra < 15 ? extra : 15));
+			if (literals >= 15) {
+				putLength(out, literals - 15);
+			}
+			out.append(source + anchor, literals);
+			out += (char)(bestDistance & 0xff);
+			out += (char)(bestDistance >> 8);
+			if (extra >= 15) {
+				putLength(out, extra - 15);
+			}
+
+			// Remember the positions the match covered, so later matches can refer back into it
+			for (size_t end = position + bestLength, i = position + 1; i < end && i <= size - MATCH_LIMIT; ++i) {
+				uint32_t skipped(hash4(source + i));
+				chain[i & MAX_DISTANCE] = head[skipped];
+				head[skipped] = i;
+			}
+			position += bestLength;
+			anchor = position;
+		}
+
+		// The block always ends with a sequence of nothing but literals
+		size_t literals(size - anchor);
+		out += (char)((literals < 15 ? literals : 15) << 4);
+		if (literals >= 15) {
+			putLength(out, literals - 15);
+		}
+		out.append(source + anchor, literals);
+	}
+
+	// Decompresses a block of sourceSize bytes from source into exactly size bytes at dest
+	// Returns false if the block is malformed, or does not decompress to exactly size bytes
+	bool decompress(const char* source, size_t sourceSize, char* dest, size_t size) {
+		size_t in(0), out(0);
+		while (in < sourceSize) {
+			unsigned char token((unsigned char)source[in++]);
+
+			size_t literals(token >> 4);
+			if (literals == 15) {
+				unsigned char byte;
+				do {
+					if (in == sourceSize) {
+						return false;
+					}
+					byte = (unsigned char)source[in++];
+					literals += byte;
+				} while (byte == 255);
+			}
+			if (literals > sourceSize - in || literals > size - out) {
+				return false;
+			}
+			memcpy(dest + out, source + in, literals);
+			in += literals;
+			out += literals;
+
+			if (in == sourceSize) { // The last sequence has no match
+				break;
+			}
+
+			if (sourceSize - in < 2) {
+				return false;
+			}
+			size_t distance((unsigned char)source[in] | ((size_t)(unsigned char)source[in + 1] << 8));
+			in += 2;
+			if (!distance || distance > out) {
+				return false;
+			}
+
+			size_t length(token & 15);
+			if (length == 15) {
+				unsigned char byte;
+				do {
+					if (in == sourceSize) {
+						return false;
+					}
+					byte = (unsigned char)source[in++];
+					length += byte;
+				} while (byte == 255);
+			}
+			length += MIN_MATCH;
+			if (length > size - out) {
+				return false;
+			}
+
+			// Matches may overlap the bytes they produce, in which case they must be copied one at a time
+			if (distance >= length) {
+				memcpy(dest + out, dest + out - distance, length);
+			}
+			else {
+				for (size_t i = 0; i < length; ++i) {
+					dest[out + i] = dest[out - distance + i];
+				}
+			}
+			out += length;
+		}
+		return out == size;
+	}
+}
+
+// Compressed objects: A short header, then the contents in independently compressed blocks, so they can be decompressed as they're written out
+namespace encoding {
+	const std::string LZ4("lz4");
+	const std::string MAGIC("HERO LZ4");
+	const size_t BLOCK_SIZE = 1 << 20;
+	const size_t MAX_BLOCK_SIZE = 1 << 30; // The largest block size accepted when reading, leaving room for the block size to change
+	const uint32_t STORED = 0x80000000u; // Marks a block which didn't compress, and is stored as it is
+
+	// Estimates, in bits per byte, how much information the contents hold from up to two samples of them
+	// Anything already compressed (or encrypted, or random) comes out near 8, while text is usually 4 to 5.
+	double entropy(const char* data, uint64_t size) {
+		const uint64_t SAMPLE = 1 << 16;
+		uint64_t counts[256] = { 0 };
+		uint64_t total(0);
+
+		// Sample the start, which may be an uncompressed header, and the middle, which is more typical of the body
+		uint64_t starts[2] = { 0, size > 2 * SAMPLE ? size / 2 : size };
+		for (uint64_t start : starts) {
+			for (uint64_t i = start; i < size && i < start + SAMPLE; ++i) {
+				++counts[(unsigned char)data[i]];
+				++total;
+			}
+		}
+		if (!total) {
+			return 0;
+		}
+
+		double bits(0);
+		for (uint64_t count : counts) {
+			if (count) {
+				double p((double)count / total);
+				bits -= p * std::log2(p);
+			}
+		}
+		return bits;
+	}
+
+	// Returns whether contents of this size and entropy are worth trying to compress
+	bool worthCompressing(const char* data, uint64_t size) {
+		return size >= 256 && entropy(data, size) < 7.5;
+	}
+
+	void putBigEndian(std::ostream& out, uint32_t value) {
+		char bytes[4] = { (char)(value >> 24), (char)(value >> 16), (char)(value >> 8), (char)value };
+		out.write(bytes, 4);
+	}
+
+	// Writes size bytes from data to out as a compressed object, at the given level
+	// Returns the number of bytes written, or 0 if they could not be written
+	uint64_t encode(const char* data, uint64_t size, std::ostream& out, int level) {
+		out << MAGIC << "\nsize " << size << "\nblock " << BLOCK_SIZE << "\n&&&&&\n";
+		uint64_t written((uint64_t)out.tellp());
+
+		std::string block;
+		for (uint64_t offset = 0; offset < size; offset += BLOCK_SIZE) {
+			size_t length((size_t)(size - offset < BLOCK_SIZE ? size - offset : BLOCK_SIZE));
+			lz4::compress(data + offset, length, block, level);
+			if (block.size() < length) {
+				putBigEndian(out, (uint32_t)block.size());
+				out.write(block.data(), block.size());
+				written += 4 + block.size();
+			}
+			else {
+				putBigEndian(out, (uint32_t)length | STORED);
+				out.write(data + offset, length);
+				written += 4 + length;
+			}
+		}
+		return out ? written : 0;
+	}
+
+	// Sets value to the decimal number making up all of text
+	// Returns false if text is anything else
+	bool parseNumber(const char* text, uint64_t& value) {
+		if (!isdigit((unsigned char)*text)) {
+			return false;
+		}
+		char* end;
+		errno = 0;
+		value = strtoull(text, &end, 10);
+		return !*end && errno != ERANGE;
+	}
+
+	// Reads the header of a compressed object, leaving in at its first block
+	// Returns false if in does not hold a compressed object, or its header is corrupt
+	bool readHeader(std::istream& in, uint64_t& size, uint64_t& blockSize) {
+		std::string line;
+		if (!std::getline(in, line) || line != MAGIC) {
+			return false;
+		}
+		size = 0;
+		blockSize = 0;
+		while (std::getline(in, line) && line != "&&&&&") {
+			if (!line.find("size ")) {
+				if (!parseNumber(line.c_str() + 5, size)) { // 5 characters: "size "
+					return false;
+				}
+			}
+			else if (!line.find("block ")) {
+				if (!parseNumber(line.c_str() + 6, blockSize)) { // 6 characters: "block "
+					return false;
+				}
+			}
+		}
+		// Blocks are held in memory whole, so a block size no encoder would write means the header is corrupt
+		return in && blockSize && blockSize <= MAX_BLOCK_SIZE;
+	}
+
+	// Decompresses the object in in one block at a time, passing each block of contents to sink(const char*, size_t)
+	// Returns false if the object is malformed
+	template <class Sink> bool decode(std::istream& in, Sink sink) {
+		uint64_t size, blockSize;
+		if (!readHeader(in, size, blockSize)) {
+			return false;
+		}
+
+		std::vector<char> compressed, contents;
+		for (uint64_t offset = 0; offset < size; offset += blockSize) {
+			size_t length((size_t)(size - offset < blockSize ? size - offset : blockSize));
+
+			unsigned char header[4];
+			if (!in.read((char*)header, 4)) {
+				return false;
+			}
+			uint32_t stored(((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | header[3]);
+
+			if (stored & STORED) {
+				if ((stored & ~STORED) != length) {
+					return false;
+				}
+				contents.resize(length);
+				if (!in.read(contents.data(), length)) {
+					return false;
+				}
+			}
+			else {
+				if (stored > lz4::compressBound(length)) {
+					return false;
+				}
+				compressed.resize(stored);
+				contents.resize(length);
+				if (!in.read(compressed.data(), stored) || !lz4::decompress(compressed.data(), stored, contents.data(), length)) {
+					return false;
+				}
+			}
+			sink(contents.data(), length);
+		}
+		return true;
+	}
+}
+#endif // !COMPRESSION_H
@@ -6,6 +6,8 @@
 
 #include "Utils.h"
 #include <cstdlib>
+#include <cstdint>
+#include <string>
 #include <vector>
 
 // First, a shim for mkdir
@@ -36,28 +38,188 @@
 #include <Windows.h>
 #else
 #include <sys/sendfile.h>
-#include <fnctl.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+// The reflink ioctl, as <linux/fs.h> defines it. That header can't be included, since it defines macros like BLOCK_SIZE.
+struct CloneRange {
+	int64_t src_fd;
+	uint64_t src_offset;
+	uint64_t src_length;
+	uint64_t dest_offset;
+};
+#define HERO_FICLONERANGE _IOW(0x94, 13, CloneRange)
+#define HERO_FICLONE _IOW(0x94, 9, int)
 #endif
+
+// Copies size bytes of in, starting at offset, to out, which must be empty, in the cheapest way the kernel offers
+// First choice is a reflink, which shares the blocks between the files on copy-on-write filesystems (btrfs, XFS), so nothing is copied at all.
+// Then copy_file_range, which copies within the kernel (and may reflink anyways), then sendfile.
+// Each of these may be unsupported, or copy less than asked for, so each picks up where the last stopped.
+// Returns how many bytes are left, which the caller must copy itself starting from offset, which is moved past what was copied
+uint64_t kernelCopy(int in, uint64_t& offset, int out, uint64_t size) {
+#if defined(__linux__)
+	// FICLONERANGE is FICLONE for part of a file. The range must be aligned to blocks, unless it runs to the end of the file.
+	CloneRange range;
+	range.src_fd = in;
+	range.src_offset = offset;
+	range.src_length = size;
+	range.dest_offset = 0;
+	if (size && !ioctl(out, HERO_FICLONERANGE, &range) && lseek(out, (off_t)size, SEEK_SET) >= 0) {
+		offset += size;
+		return 0;
+	}
+
+	// copy_file_range isn't available on older kernels, or (before Linux 5.3) across filesystems.
+	loff_t in_offset(offset);
+	while (size) {
+		ssize_t copied(copy_file_range(in, &in_offset, out, nullptr, size, 0));
+		if (copied <= 0) {
+			if (copied < 0 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		size -= copied;
+	}
+
+	// sendfile can copy from a file since Linux 2.6.33, but only up to about 2GB at a time
+	off_t send_offset(in_offset);
+	while (size) {
+		ssize_t copied(sendfile(out, in, &send_offset, size));
+		if (copied <= 0) {
+			if (copied < 0 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		size -= copied;
+	}
+	offset = send_offset;
+#endif
+	return size;
+}
+#endif
+// Copies the file at source to dest, replacing any file there. On POSIX, dest gets the permissions of source.
 // Returns whether the operation succeeded
 bool copyfile(const char* source, const char* dest) {
 #if defined(_WIN32)
-	return CopyFile(source, dest, false);
-#else // I'm not sure if this will work. I think it will, but...
-	int src = open(source, O_RDONLY, 0);
-	int dest = open(dest, O_WRONLY | O_CREAT | O_TRUNC);
-
+	// CopyFile already clones blocks where the filesystem supports it
+	return CopyFile(source, dest, false) != 0;
+#else
+	int src(open(source, O_RDONLY | O_CLOEXEC));
+	if (src < 0) {
+		return false;
+	}
 	struct stat stat_source;
-	fstat(src, &stat_source);
+	if (fstat(src, &stat_source)) {
+		close(src);
+		return false;
+	}
+	int dst(open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, stat_source.st_mode & 0777));
+	if (dst < 0) {
+		close(src);
+		return false;
+	}
+
+	uint64_t offset(0);
+	uint64_t size(kernelCopy(src, offset, dst, (uint64_t)stat_source.st_size));
 
-	bool out = sendfile(dest, src, 0, stat_source.st_size);
+	// Last resort: Read and write it ourselves
+	bool good(true);
+	if (size) {
+		std::vector<char> buffer(1 << 16);
+		while (good && size) {
+			ssize_t count(pread(src, buffer.data(), size < buffer.size() ? (size_t)size : buffer.size(), (off_t)offset));
+			if (count < 0 && errno == EINTR) {
+				continue;
+			}
+			good = (count > 0);
+			for (ssize_t done = 0; good && done < count;) {
+				ssize_t written(write(dst, buffer.data() + done, count - done));
+				if (written < 0 && errno == EINTR) {
+					continue;
+				}
+				good = (written > 0);
+				done += written;
+			}
+			if (good) {
+				offset += count;
+				size -= count;
+			}
+		}
+	}
 
 	close(src);
-	close(dest);
+	return close(dst) == 0 && good;
+#endif
+}
 
-	return out;
+// Makes dest a copy of the file at source which shares its blocks, on filesystems which can (btrfs, XFS), so nothing is copied at all
+// Returns false, leaving nothing at dest, where the filesystem can't
+bool reflinkFile(const char* source, const char* dest) {
+#if defined(__linux__)
+	int src(open(source, O_RDONLY | O_CLOEXEC));
+	if (src < 0) {
+		return false;
+	}
+	struct stat stat_source;
+	if (fstat(src, &stat_source)) {
+		close(src);
+		return false;
+	}
+	int dst(open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, stat_source.st_mode & 0777));
+	if (dst < 0) {
+		close(src);
+		return false;
+	}
+
+	bool cloned(!ioctl(dst, HERO_FICLONE, src));
+	close(src);
+	if (close(dst) || !cloned) {
+		remove(dest);
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+// Next, functions for hard links
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+// Makes link another name for the file at existing. Both must be on the same filesystem.
+// Returns whether the operation succeeded
+bool linkFile(const std::string& existing, const std::string& link) {
+#if defined(_WIN32)
+	return CreateHardLink(link.c_str(), existing.c_str(), NULL) != 0;
+#else
+	return !::link(existing.c_str(), link.c_str());
+#endif
+}
+
+// Returns the number of names the file at filename has, or 0 if it can't be found
+uint64_t linkCount(const std::string& filename) {
+#if defined(_WIN32)
+	HANDLE file(CreateFile(filename.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL));
+	if (file == INVALID_HANDLE_VALUE) {
+		return 0;
+	}
+	BY_HANDLE_FILE_INFORMATION info;
+	bool found(GetFileInformationByHandle(file, &info) != 0);
+	CloseHandle(file);
+	return found ? info.nNumberOfLinks : 0;
+#else
+	struct stat file_stat;
+	return stat(filename.c_str(), &file_stat) ? 0 : (uint64_t)file_stat.st_nlink;
 #endif
 }
 
@@ -70,6 +232,31 @@ bool copyfile(const char* source, const char* dest) {
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <fcntl.h>
+#include <cstring>
+
+// Returns the type (as the S_IFMT bits of st_mode) of the entry ent read from direc, or 0 if it can't be found
+// The type comes from the directory entry itself where the filesystem records it there. Only otherwise is the entry statted.
+// Symbolic links are followed, so a link counts as whatever it points to.
+mode_t direntType(DIR* direc, const struct dirent* ent) {
+	switch (ent->d_type) {
+	case DT_REG:
+		return S_IFREG;
+	case DT_DIR:
+		return S_IFDIR;
+	case DT_UNKNOWN:
+	case DT_LNK:
+		break;
+	default:
+		return DTTOIF(ent->d_type);
+	}
+
+	struct stat file_stat;
+	if (fstatat(dirfd(direc), ent->d_name, &file_stat, 0)) {
+		return 0;
+	}
+	return file_stat.st_mode & S_IFMT;
+}
 #endif
 // Returns either 0 or an error code
 int filesInDirectory(std::string dir, std::vector<std::string>& out) {
@@ -98,16 +285,12 @@ int filesInDirectory(std::string dir, std::vector<std::string>& out) {
 #else
 	DIR* direc;
 	struct dirent* ent;
-	struct stat file_stat;
-	dir += "/";
 	if ((direc = opendir(dir.c_str())) != NULL) {
-		while (ent = readdir(direc) != NULL) {
-			if (stat((dir + end->d_name).c_str(), &file_stat))
-				out.push_back(ent->d_name); // In case of error, assume regular file
-			if (S_ISREG(file_stat.st_mode)) // Otherwise, only push regular files
+		while ((ent = readdir(direc)) != NULL) {
+			if (direntType(direc, ent) == S_IFREG) // Only push regular files
 				out.push_back(ent->d_name);
 		}
-		closedir(dir);
+		closedir(direc);
 		return 0;
 	}
 	else
@@ -146,18 +329,15 @@ int contentsOfDirectory(std::string dir, std::vector<std::string>& out) {
 #else
 	DIR* direc;
 	struct dirent* ent;
-	struct stat file_stat;
-	dir += "/";
 	if ((direc = opendir(dir.c_str())) != NULL) {
-		while (ent = readdir(direc) != NULL) {
-			if (stat((dir + end->d_name).c_str(), &file_stat))
-				out.push_back(ent->d_name); // In case of error, assume regular file
-			if (S_ISREG(file_stat.st_mode)) // Otherwise, only push regular files...
+		while ((ent = readdir(direc)) != NULL) {
+			mode_t type(direntType(direc, ent));
+			if (type == S_IFREG) // Only push regular files...
 				out.push_back(ent->d_name);
-			if (S_ISDIR(file_stat.st_mode) && std::string(ent->d_name) != "." && std::string(ent->d_name) != "..") // ... Or directories that aren't . or ..
+			if (type == S_IFDIR && strcmp(ent->d_name, ".") && strcmp(ent->d_name, "..")) // ... Or directories that aren't . or ..
 				out.push_back(ent->d_name);
 		}
-		closedir(dir);
+		closedir(direc);
 		return 0;
 	}
 	else
@@ -169,6 +349,663 @@ int contentsOfDirectory(const CStr& dir, std::vector<std::string>& out) {
 	return contentsOfDirectory(dir.asStdString(), out);
 }
 
+// A class to map an entire file into memory, read-only
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+// The mapping lives as long as the object. If the file could not be mapped, the object converts to false.
+// Ranges of the mapped file can also be written straight out to other files, letting the kernel copy them where it knows how.
+// Cannot be copied.
+class MappedFile {
+public:
+	explicit MappedFile(const std::string& filename) : m_data(nullptr), m_size(0), m_good(false) {
+#if defined(_WIN32)
+		m_file = INVALID_HANDLE_VALUE;
+		m_mapping = NULL;
+
+		m_file = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (m_file == INVALID_HANDLE_VALUE) {
+			return;
+		}
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(m_file, &size)) {
+			return;
+		}
+		m_size = (uint64_t)size.QuadPart;
+		if (!m_size) { // Empty files cannot be mapped, but there's nothing to read anyways
+			m_good = true;
+			return;
+		}
+
+		m_mapping = CreateFileMapping(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (m_mapping == NULL) {
+			return;
+		}
+		m_data = (const char*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+		m_good = (m_data != nullptr);
+#else
+		m_fd = open(filename.c_str(), O_RDONLY);
+		if (m_fd < 0) {
+			return;
+		}
+
+		struct stat file_stat;
+		if (fstat(m_fd, &file_stat)) {
+			return;
+		}
+		m_size = (uint64_t)file_stat.st_size;
+		if (!m_size) { // Empty files cannot be mapped, but there's nothing to read anyways
+			m_good = true;
+			return;
+		}
+
+		void* data(mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0));
+		if (data == MAP_FAILED) {
+			return;
+		}
+		m_data = (const char*)data;
+		m_good = true;
+#endif
+	}
+
+	~MappedFile() {
+#if defined(_WIN32)
+		if (m_data) {
+			UnmapViewOfFile(m_data);
+		}
+		if (m_mapping != NULL) {
+			CloseHandle(m_mapping);
+		}
+		if (m_file != INVALID_HANDLE_VALUE) {
+			CloseHandle(m_file);
+		}
+#else
+		if (m_data) {
+			munmap((void*)m_data, m_size);
+		}
+		if (m_fd >= 0) {
+			close(m_fd);
+		}
+#endif
+	}
+
+	explicit operator bool() const {
+		return m_good;
+	}
+
+	const char* data() const {
+		return m_data;
+	}
+
+	uint64_t size() const {
+		return m_size;
+	}
+
+	// Writes size bytes of the mapped file, starting at offset, to a new file at dest (replacing any file there)
+	// On Linux, the copy is made by the kernel with kernelCopy, as a reflink where the filesystem can share the blocks.
+	// Otherwise, the mapped bytes are written out directly.
+	// Returns whether the operation succeeded
+	bool writeRange(uint64_t offset, uint64_t size, const char* dest) const {
+		if (!m_good || offset > m_size || size > m_size - offset) {
+			return false;
+		}
+
+#if defined(_WIN32)
+		HANDLE out(CreateFile(dest, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL));
+		if (out == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+
+		const char* position(m_data + offset);
+		while (size) {
+			DWORD block(size < (1u << 30) ? (DWORD)size : (1u << 30)); // WriteFile can only take 32 bits of size at a time
+			DWORD written;
+			if (!WriteFile(out, position, block, &written, NULL)) {
+				CloseHandle(out);
+				return false;
+			}
+			position += written;
+			size -= written;
+		}
+
+		return CloseHandle(out) != 0;
+#else
+		int out(open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0666));
+		if (out < 0) {
+			return false;
+		}
+
+		size = kernelCopy(m_fd, offset, out, size);
+
+		// Last resort: Plain writes from the mapping
+		const char* position(m_data + offset);
+		while (size) {
+			ssize_t written(write(out, position, size));
+			if (written < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				close(out);
+				return false;
+			}
+			position += written;
+			size -= written;
+		}
+
+		return close(out) == 0;
+#endif
+	}
+protected:
+	const char* m_data;
+	uint64_t m_size;
+	bool m_good;
+#if defined(_WIN32)
+	HANDLE m_file;
+	HANDLE m_mapping;
+#else
+	int m_fd;
+#endif
+
+private:
+	MappedFile(const MappedFile&);
+};
+
+// Next, functions to make sure what's been written to a file has reached the disk
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+// Appends size bytes from data to the file (creating it if needed), and waits until they're on disk
+// Returns whether the operation succeeded
+bool appendToFile(const std::string& filename, const char* data, size_t size) {
+#if defined(_WIN32)
+	HANDLE file(CreateFile(filename.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL));
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	while (size) {
+		DWORD block(size < (1u << 30) ? (DWORD)size : (1u << 30)); // WriteFile can only take 32 bits of size at a time
+		DWORD written;
+		if (!WriteFile(file, data, block, &written, NULL)) {
+			CloseHandle(file);
+			return false;
+		}
+		data += written;
+		size -= written;
+	}
+
+	bool flushed(FlushFileBuffers(file) != 0);
+	return CloseHandle(file) != 0 && flushed;
+#else
+	int file(open(filename.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0666));
+	if (file < 0) {
+		return false;
+	}
+
+	while (size) {
+		ssize_t written(write(file, data, size));
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			close(file);
+			return false;
+		}
+		data += written;
+		size -= written;
+	}
+
+	bool flushed(fsync(file) == 0);
+	return close(file) == 0 && flushed;
+#endif
+}
+
+// Waits until everything written to the file is on disk
+// Returns whether the operation succeeded
+bool syncFile(const std::string& filename) {
+#if defined(_WIN32)
+	HANDLE file(CreateFile(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL));
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	bool flushed(FlushFileBuffers(file) != 0);
+	return CloseHandle(file) != 0 && flushed;
+#else
+	int file(open(filename.c_str(), O_RDONLY)); // fsync doesn't need the file to be writable, and it may not be
+	if (file < 0) {
+		return false;
+	}
+	bool flushed(fsync(file) == 0);
+	return close(file) == 0 && flushed;
+#endif
+}
+
+// Next, a function to read the metadata which tells whether a file has changed without reading it
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+// Times are in the platform's own units: Nanoseconds since 1970 on POSIX, and 100 nanosecond intervals since 1601 on Windows.
+// Windows has no inode change time, so the creation time stands in for it there.
+struct FileStat {
+	uint64_t mtime;
+	uint64_t ctime;
+	uint64_t size;
+	uint64_t inode;
+	uint64_t device;
+
+	bool operator==(const FileStat& other) const {
+		return mtime == other.mtime && ctime == other.ctime && size == other.size && inode == other.inode && device == other.device;
+	}
+
+	bool operator!=(const FileStat& other) const {
+		return !(*this == other);
+	}
+};
+
+#if !defined(_WIN32)
+// Converts the metadata stat() reads into a FileStat
+FileStat fileStat(const struct stat& file_stat) {
+	FileStat out;
+#if defined(__APPLE__)
+	out.mtime = (uint64_t)file_stat.st_mtimespec.tv_sec * 1000000000 + file_stat.st_mtimespec.tv_nsec;
+	out.ctime = (uint64_t)file_stat.st_ctimespec.tv_sec * 1000000000 + file_stat.st_ctimespec.tv_nsec;
+#else
+	out.mtime = (uint64_t)file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec;
+	out.ctime = (uint64_t)file_stat.st_ctim.tv_sec * 1000000000 + file_stat.st_ctim.tv_nsec;
+#endif
+	out.size = (uint64_t)file_stat.st_size;
+	out.inode = (uint64_t)file_stat.st_ino;
+	out.device = (uint64_t)file_stat.st_dev;
+	return out;
+}
+#endif
+
+// Returns whether the metadata of the file could be read
+bool statFile(const std::string& filename, FileStat& out) {
+#if defined(_WIN32)
+	HANDLE file(CreateFile(filename.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL));
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	BY_HANDLE_FILE_INFORMATION info;
+	bool good(GetFileInformationByHandle(file, &info) != 0);
+	CloseHandle(file);
+	if (!good) {
+		return false;
+	}
+
+	out.mtime = ((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+	out.ctime = ((uint64_t)info.ftCreationTime.dwHighDateTime << 32) | info.ftCreationTime.dwLowDateTime;
+	out.size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	out.inode = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+	out.device = info.dwVolumeSerialNumber;
+	return true;
+#else
+	struct stat file_stat;
+	if (stat(filename.c_str(), &file_stat)) {
+		return false;
+	}
+	out = fileStat(file_stat);
+	return true;
+#endif
+}
+
+// Next, a function to walk a whole tree of directories
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cstring>
+#endif
+// What walkTree found at a path
+enum class FileType : uint8_t { file, directory };
+
+// Returns what to put before the names of the entries of dir to make their paths: Nothing for ".", or dir and a separator
+std::string directoryPrefix(const std::string& dir) {
+	if (dir == ".") {
+		return "";
+	}
+	return (dir.size() && (dir.back() == '/' || dir.back() == '\\')) ? dir : dir + "/";
+}
+
+// Walks root and every directory under it, one directory at a time rather than by recursion
+// visit(path, type, stat) is called for every regular file and directory found. Directories are only entered if it returns true for them.
+// stat holds the metadata of files, read as the walk finds them, so callers need not stat them again. For directories, it's empty.
+// If root is a file, it's the only thing visited. Links to files are visited as those files, but links to directories are never entered.
+// On POSIX, each directory is opened relative to the one holding it and each file is statted relative to its directory,
+//   so no path is resolved more than once, and directories are known by the type their parent records for them without being statted.
+// include(path, type) is called first for everything under root, before it's statted or opened. Whatever it returns false for is skipped entirely.
+// Returns either 0 or an error code, from root or the first directory which couldn't be read
+template <class Filter, class F> int walkTree(const std::string& root, Filter include, F visit) {
+#if defined(_WIN32)
+	DWORD attributes(GetFileAttributes(root.c_str()));
+	if (attributes == INVALID_FILE_ATTRIBUTES) {
+		return (int)GetLastError();
+	}
+	if (!(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		FileStat stat;
+		if (statFile(root, stat)) {
+			visit(root, FileType::file, stat);
+		}
+		return 0;
+	}
+	if (!visit(root, FileType::directory, FileStat())) {
+		return 0;
+	}
+
+	std::vector<std::string> pending(1, root);
+	while (!pending.empty()) {
+		std::string prefix(directoryPrefix(pending.back()));
+		std::string search(prefix.size() ? prefix + "*" : "*");
+		pending.pop_back();
+
+		WIN32_FIND_DATA ffd;
+		HANDLE hFind(FindFirstFile(search.c_str(), &ffd));
+		if (hFind == INVALID_HANDLE_VALUE) {
+			return (int)GetLastError();
+		}
+		do {
+			std::string name(ffd.cFileName);
+			if (name == "." || name == "..") {
+				continue;
+			}
+			std::string path(prefix + name);
+			if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+				if (!(ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) && include(path, FileType::directory) && visit(path, FileType::directory, FileStat())) {
+					pending.push_back(path);
+				}
+			}
+			else if (include(path, FileType::file)) {
+				FileStat stat;
+				if (statFile(path, stat)) {
+					visit(path, FileType::file, stat);
+				}
+			}
+		} while (FindNextFile(hFind, &ffd));
+		DWORD err(GetLastError());
+		FindClose(hFind);
+		if (err != ERROR_NO_MORE_FILES) {
+			return (int)err;
+		}
+	}
+	return 0;
+#else
+	struct stat file_stat;
+	if (stat(root.c_str(), &file_stat)) {
+		return errno;
+	}
+	if (!S_ISDIR(file_stat.st_mode)) {
+		if (S_ISREG(file_stat.st_mode)) {
+			visit(root, FileType::file, fileStat(file_stat));
+		}
+		return 0;
+	}
+	if (!visit(root, FileType::directory, FileStat())) {
+		return 0;
+	}
+
+	// Every directory between root and the one being read stays open, so the next one can be opened relative to it
+	struct Level {
+		DIR* dir;
+		std::string prefix;
+	};
+	std::vector<Level> open;
+	DIR* top(opendir(root.c_str()));
+	if (!top) {
+		return errno;
+	}
+	open.push_back(Level{ top, directoryPrefix(root) });
+
+	int err(0);
+	while (!open.empty()) {
+		errno = 0;
+		struct dirent* ent(readdir(open.back().dir));
+		if (!ent) {
+			if (errno) {
+				err = errno;
+				break;
+			}
+			closedir(open.back().dir);
+			open.pop_back();
+			continue;
+		}
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+			continue;
+		}
+
+		int fd(dirfd(open.back().dir));
+		std::string path(open.back().prefix + ent->d_name);
+		if (ent->d_type != DT_DIR) {
+			// Files are statted anyway, and so is anything whose type the directory doesn't record
+			if (ent->d_type != DT_REG && ent->d_type != DT_LNK && ent->d_type != DT_UNKNOWN) {
+				continue;
+			}
+			if (ent->d_type == DT_REG && !include(path, FileType::file)) {
+				continue; // Skipped without being statted
+			}
+			if (fstatat(fd, ent->d_name, &file_stat, AT_SYMLINK_NOFOLLOW)) {
+				continue; // Removed since the directory was read
+			}
+			if (S_ISLNK(file_stat.st_mode) && (fstatat(fd, ent->d_name, &file_stat, 0) || !S_ISREG(file_stat.st_mode))) {
+				continue; // Links only count as the files they point to
+			}
+			if (S_ISREG(file_stat.st_mode)) {
+				if (ent->d_type == DT_REG || include(path, FileType::file)) {
+					visit(path, FileType::file, fileStat(file_stat));
+				}
+				continue;
+			}
+			if (!S_ISDIR(file_stat.st_mode)) {
+				continue;
+			}
+		}
+
+		if (include(path, FileType::directory) && visit(path, FileType::directory, FileStat())) {
+			int sub(openat(fd, ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+			DIR* dir(sub < 0 ? nullptr : fdopendir(sub));
+			if (!dir) {
+				err = errno;
+				if (sub >= 0) {
+					close(sub);
+				}
+				break;
+			}
+			open.push_back(Level{ dir, path + "/" });
+		}
+	}
+
+	for (const auto& level : open) {
+		closedir(level.dir);
+	}
+	return err;
+#endif
+}
+
+// Walks root and every directory under it, visiting everything in them
+template <class F> int walkTree(const std::string& root, F visit) {
+	return walkTree(root, [](const std::string&, FileType) { return true; }, visit);
+}
+
+// Next, functions to replace files so that a crash leaves either the old file or the new one, never part of either
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstdio>
+#endif
+#include <set>
+#include <utility>
+// Waits until the entries of the directory (the names of the files in it, and which files they name) are on disk
+// Returns whether the operation succeeded
+bool syncDirectory(const std::string& dir) {
+#if defined(_WIN32)
+	return true; // NTFS journals the directory along with the rename itself, which replaceFile writes through
+#else
+	int file(open(dir.size() ? dir.c_str() : ".", O_RDONLY));
+	if (file < 0) {
+		return false;
+	}
+	bool flushed(fsync(file) == 0);
+	return close(file) == 0 && flushed;
+#endif
+}
+
+// Returns the directory holding filename, or an empty string for the current directory
+std::string parentDirectory(const std::string& filename) {
+	size_t slash(filename.find_last_of("/\\"));
+	return slash == std::string::npos ? "" : filename.substr(0, slash ? slash : 1);
+}
+
+// Renames source to dest in one step, replacing any file at dest
+// Returns whether the operation succeeded
+bool replaceFile(const std::string& source, const std::string& dest) {
+#if defined(_WIN32)
+	return MoveFileEx(source.c_str(), dest.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return rename(source.c_str(), dest.c_str()) == 0;
+#endif
+}
+
+// Writes size bytes from data to filename without ever leaving it partly written
+// The data is written to a temporary file beside it, which is flushed to disk, renamed over filename, and then the rename is flushed too.
+// Returns whether the file was replaced
+bool writeFileDurably(const std::string& filename, const char* data, size_t size) {
+	std::string partial(filename + "_PARTIAL");
+	remove(partial.c_str());
+	if (!appendToFile(partial, data, size) || !replaceFile(partial, filename)) {
+		remove(partial.c_str());
+		return false;
+	}
+	return syncDirectory(parentDirectory(filename));
+}
+
+bool writeFileDurably(const std::string& filename, const std::string& data) {
+	return writeFileDurably(filename, data.data(), data.size());
+}
+
+// Asks the kernel to start writing the file's contents to disk, without waiting for them to get there
+// Only Linux can do this. Elsewhere it does nothing, and the contents are written when the file is synced.
+void startWriteback(const std::string& filename) {
+#if defined(__linux__)
+	int file(open(filename.c_str(), O_RDONLY));
+	if (file >= 0) {
+		sync_file_range(file, 0, 0, SYNC_FILE_RANGE_WRITE);
+		close(file);
+	}
+#endif
+}
+
+// Waits until the contents of every file are on disk, or if directories is set, the entries naming them in their directories
+// Callers write every file first, and only then flush them all, so the writes can reach the disk together rather than one at a time.
+//   Writeback is started on every file before any is waited on, so the disk gets all of them at once.
+//   Each fsync after the first then mostly finds its data already written, and the journal commit it needs already made by an earlier one.
+// Each file is still flushed by itself, so only our own data is waited on, and any error writing it back is reported. Directories are flushed once each.
+// Returns whether the operation succeeded
+bool syncFiles(const std::vector<std::string>& files, bool directories = false) {
+	if (!directories) {
+		for (const auto& name : files) {
+			startWriteback(name);
+		}
+		for (const auto& name : files) {
+			if (!syncFile(name)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	std::set<std::string> synced;
+	for (const auto& name : files) {
+		std::string directory(parentDirectory(name));
+		if (synced.insert(directory).second && !syncDirectory(directory)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Moves many files into place at once, each only once its contents are on disk
+// Files are written under temporary names, then added along with the names they replace. commit() flushes every one of them,
+//   renames each into place, and then flushes the renames, so a crash leaves every file whole: Either as it was, or as it was written.
+// Files which were never committed are removed when the batch is abandoned or destroyed.
+// Cannot be copied.
+class ReplaceBatch {
+public:
+	ReplaceBatch() {}
+
+	~ReplaceBatch() {
+		abandon();
+	}
+
+	// Adds the file written at partial, which is to replace target
+	void add(const std::string& partial, const std::string& target) {
+		m_partial.push_back(partial);
+		m_target.push_back(target);
+	}
+
+	size_t size() const {
+		return m_target.size();
+	}
+
+	// Moves every file into place, and waits until they're all on disk
+	// Returns whether every file was moved. If any could not be, none of the rest are, and every file not moved is removed.
+	bool commit() {
+		bool good(syncFiles(m_partial));
+		size_t moved(0);
+		while (good && moved < m_target.size()) {
+			if (replaceFile(m_partial[moved], m_target[moved])) {
+				++moved;
+			}
+			else {
+				good = false;
+			}
+		}
+		m_target.resize(moved);
+		good = syncFiles(m_target, true) && good;
+
+		m_partial.erase(m_partial.begin(), m_partial.begin() + moved);
+		abandon();
+		return good;
+	}
+
+	// Removes every file which hasn't been moved into place
+	void abandon() {
+		for (const auto& partial : m_partial) {
+			remove(partial.c_str());
+		}
+		m_partial.clear();
+		m_target.clear();
+	}
+private:
+	std::vector<std::string> m_partial;
+	std::vector<std::string> m_target;
+
+	ReplaceBatch(const ReplaceBatch&);
+};
+
 // All functions below here are not technically shims, but they depend on the above and are not currently numerous enough to merit their own header.
 
 // emptyDirectory: Deletes all files in a given directory
@@ -229,4 +1066,19 @@ bool copyDirectory(const std::string& source, const std::string& dest) {
 template<class A, class B> bool copyDirectory(const A& source, const B& dest) {
 	return copyDirectory(std::string(source), std::string(dest));
 }
+
+// Finally, a way to tell this process's temporary files from another's
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <unistd.h>
+#endif
+// Returns the ID of the running process
+uint64_t processId() {
+#if defined(_WIN32)
+	return GetCurrentProcessId();
+#else
+	return (uint64_t)getpid();
+#endif
+}
 #endif // !CROSSPLATFORM_H
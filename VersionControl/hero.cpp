@@ -7,6 +7,14 @@
 #include "Utils.h"
 #include "hero.h"
 #include "classes/indexmap.h"
+#include "classes/commitreader.h"
+#include "classes/commitwriter.h"
+#include "classes/commitgraph.h"
+#include "classes/threadpool.h"
+#include "classes/packfile.h"
+#include "classes/config.h"
+#include "classes/ignorerules.h"
+#include "compression.h"
 
 #include <iostream>
 #include <cstdint>
@@ -18,18 +26,38 @@
 #include <vector>
 #include <iomanip>
 #include <cctype>
+#include <future>
+#include <mutex>
+#include <set>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <utility>
 
 // Internal codes for commands which we know how to handle, plus an error code (unknownCommand)
-enum class Command : uint8_t { unknownCommand, init, add, commit, commitLast, commitFiles, log, checkout };
+enum class Command : uint8_t { unknownCommand, init, add, commit, commitLast, commitFiles, log, status, checkout, pack };
+
+// Which commits log shows, and how
+struct LogOptions {
+	size_t limit; // The most commits to show, or 0 for all of them
+	int64_t since; // Only commits made at or after this time, in seconds since 1970...
+	int64_t until; // ... and at or before this one
+	std::string grep; // Only commits whose titles contain this
+	bool oneline; // Show each commit as its hash and title on one line
+
+	LogOptions() : limit(0), since(INT64_MIN), until(INT64_MAX), oneline(false) {}
+};
 
 // Function declarations for running commands
 void init();
-void add(const std::vector<std::string>&);
+void add(const std::vector<std::string>&, size_t);
 void commit();
 void commitLast();
 void commitFiles(const std::vector<std::string>&);
-void log();
-void checkout(std::string);
+void log(const LogOptions&);
+void status(size_t);
+void checkout(std::string, size_t, bool);
+void pack();
 
 // Issue the usage message appropriate to the command being run, with the command we were invoked with
 void usage(char* invoke, Command source) {
@@ -42,9 +70,10 @@ void usage(char* invoke, Command source) {
 		std::cout << "No arguments are required or allowed.\n";
 		break;
 	case Command::add:
-		std::cout << invoke << " add [files]\n";
+		std::cout << invoke << " add [--jobs N] [files]\n";
 		std::cout << "Adds a file or several files to the index, using their state on disk at the time of invocation.\n";
 		std::cout << "Accepts an arbitrary number of arguments, all of which must be files on disk to add (excepting \"-h\" to produce this output).\n";
+		std::cout << "Files are hashed and copied into the index on as many threads as the machine can run, unless \'--jobs N\' (or \'-j N\') limits it to N.\n";
 		std::cout << "Note that if added files are changed while this command is running, the index may be left in an inconsistent state.\n";
 		break;
 	case Command::commit:
@@ -56,31 +85,91 @@ void usage(char* invoke, Command source) {
 		std::cout << "Note that if the index is altered while this command is running, the commit may be produced in an inconsistent state.\n";
 		break;
 	case Command::log:
-		std::cout << invoke << " log\n";
-		std::cout << "Outputs a version history of the repository by commits.\n";
-		std::cout << "No arguments are required or allowed.\n";
+		std::cout << invoke << " log [-n N] [--since DATE] [--until DATE] [--grep TEXT] [--oneline]\n";
+		std::cout << "Outputs a version history of the repository by commits, newest first.\n";
+		std::cout << "If \'-n N\' is present, at most N commits are shown.\n";
+		std::cout << "If \'--since DATE\' or \'--until DATE\' is present, only commits made from or until DATE (in UTC) are shown.\n";
+		std::cout << "  DATE is written as YYYY-MM-DD, optionally followed by a space and HH:MM:SS. A date alone covers the whole day.\n";
+		std::cout << "  History is assumed to be in order of time, so the log ends at the first commit made before \'--since\'.\n";
+		std::cout << "If \'--grep TEXT\' is present, only commits whose titles contain TEXT are shown.\n";
+		std::cout << "If \'--oneline\' is present, each commit is shown as an abbreviated hash and its title on a single line.\n";
+		break;
+	case Command::status:
+		std::cout << invoke << " status [--jobs N]\n";
+		std::cout << "Lists the files which differ between the checked out commit, the index, and the working directory.\n";
+		std::cout << "Files in the index are compared against what was added. Every other file is compared against what was committed.\n";
+		std::cout << "Files in neither are listed as untracked, unless the .heroignore matches them.\n";
+		std::cout << "Only files whose size, times or identity on disk changed since they were last added, committed or checked are read.\n";
+		std::cout << "They are hashed on as many threads as the machine can run, unless \'--jobs N\' (or \'-j N\') limits it to N.\n";
 		break;
 	case Command::checkout:
-		std::cout << invoke << " checkout <reference>\n";
+		std::cout << invoke << " checkout [--jobs N] [--incremental] <reference>\n";
 		std::cout << "Checks out the files committed in the referenced commit.\n";
 		std::cout << "<reference> can be any of:\n";
-		std::cout << "  1. The hash of the commit to check out\n";
+		std::cout << "  1. The hash of the commit to check out, or enough of its beginning (at least 4 characters) that no other commit shares it\n";
 		std::cout << "  2. HEAD\n";
+		std::cout << "Either may be followed by \'~N\' to check out the commit N generations before it, so HEAD~1 is the parent of HEAD. \'~\' alone means \'~1\'.\n";
 		std::cout << "Any other input is considered an error.\n";
+		std::cout << "If \'--jobs N\' (or \'-j N\') is present, up to N files are written and verified at once.\n";
+		std::cout << "N may be 0, to use as many as the machine can run at once. By default, files are checked out one at a time.\n";
+		std::cout << "If \'--incremental\' is present, nothing is asked. Only the files which differ from the working directory are written,\n";
+		std::cout << "  and files tracked by the previously checked out commit but not by this one are removed, unless they were changed.\n";
+		std::cout << "  Files whose size, times and identity on disk are unchanged since they were last committed or checked out aren't read.\n";
+		break;
+	case Command::pack:
+		std::cout << invoke << " pack\n";
+		std::cout << "Gathers the file contents stored for every commit reachable from HEAD into a single packfile.\n";
+		std::cout << "Each is stored whole, or as a delta against a similar file, whichever is smaller.\n";
+		std::cout << "Packs made earlier are merged into the new pack. No arguments are required or allowed.\n";
 		break;
 	case Command::unknownCommand:
 	default:
 		std::cout << invoke << " init\n";
 		std::cout << invoke << " add [files]\n";
 		std::cout << invoke << " commit [files] [-a]\n";
-		std::cout << invoke << " log\n";
+		std::cout << invoke << " log [options]\n";
+		std::cout << invoke << " status\n";
+		std::cout << invoke << " pack\n";
 		break;
 	}
 	exit(0);
 }
 
+// Reads a date given to log, as YYYY-MM-DD with an optional HH:MM:SS, into seconds since 1970
+// A date alone means its first second, or its last if end is set.
+// Returns false if the date could not be parsed
+bool parseLogDate(const std::string& arg, bool end, int64_t& seconds) {
+	size_t split(arg.find_first_of(" T"));
+	if (split == std::string::npos) {
+		if (!parseCommitTime(arg, "", seconds)) {
+			return false;
+		}
+		if (end) {
+			seconds += 86400 - 1;
+		}
+		return true;
+	}
+	return parseCommitTime(arg.substr(0, split), arg.substr(split + 1), seconds);
+}
+
+// Reads the argument to --jobs, where 0 means as many as the machine can run at once
+// Returns 0 if the argument is not a number
+size_t jobCount(const char* arg) {
+	if (!isdigit(arg[0])) {
+		return 0;
+	}
+
+	size_t jobs(strtoul(arg, nullptr, 10));
+	return jobs ? jobs : ThreadPool::hardwareThreads();
+}
+
 int main(int argc, char* argv[]) {
 	Command mode=Command::unknownCommand;
+	std::string reference; // The commit to check out
+	LogOptions logOptions; // Which commits to log
+	size_t jobs(0); // How many files may be worked on at once, if given on the commandline
+	bool incremental(false); // Whether checkout only writes the files which differ, without asking
+	std::vector<std::string> files; // The files named on the commandline
 
 	// First, argument handling.
 	if (argc < 2) {
@@ -97,6 +186,18 @@ int main(int argc, char* argv[]) {
 		if (!strcmp(argv[2], "-h")) {
 			usage(argv[0], Command::add);
 		}
+
+		files.reserve(argc - 2); // Reserve enough space for all files
+		for (int i = 2; i < argc; ++i) {
+			if (!strcmp(argv[i], "--jobs") || !strcmp(argv[i], "-j")) {
+				if (++i == argc || !(jobs = jobCount(argv[i]))) {
+					usage(argv[0], Command::add);
+				}
+			}
+			else {
+				files.emplace_back(argv[i]);
+			}
+		}
 	}
 	else if (!strcmp(argv[1], "commit")) {
 		mode = Command::commit;
@@ -116,17 +217,81 @@ int main(int argc, char* argv[]) {
 	else if (!strcmp(argv[1], "log")) {
 		mode = Command::log;
 
-		if (argc > 2) {
-			usage(argv[0], Command::log);
+		for (int i = 2; i < argc; ++i) {
+			if (!strcmp(argv[i], "--oneline")) {
+				logOptions.oneline = true;
+			}
+			else if (i + 1 == argc) { // Every other option takes an argument
+				usage(argv[0], Command::log);
+			}
+			else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--max-count")) {
+				++i;
+				if (!isdigit(argv[i][0]) || !(logOptions.limit = strtoul(argv[i], nullptr, 10))) {
+					usage(argv[0], Command::log);
+				}
+			}
+			else if (!strcmp(argv[i], "--since")) {
+				if (!parseLogDate(argv[++i], false, logOptions.since)) {
+					usage(argv[0], Command::log);
+				}
+			}
+			else if (!strcmp(argv[i], "--until")) {
+				if (!parseLogDate(argv[++i], true, logOptions.until)) {
+					usage(argv[0], Command::log);
+				}
+			}
+			else if (!strcmp(argv[i], "--grep")) {
+				logOptions.grep = argv[++i];
+			}
+			else {
+				usage(argv[0], Command::log);
+			}
+		}
+	}
+	else if (!strcmp(argv[1], "status")) {
+		mode = Command::status;
+
+		for (int i = 2; i < argc; ++i) {
+			if ((strcmp(argv[i], "--jobs") && strcmp(argv[i], "-j")) || ++i == argc || !(jobs = jobCount(argv[i]))) {
+				usage(argv[0], Command::status);
+			}
 		}
 	}
 	else if (!strcmp(argv[1], "checkout")) {
 		mode = Command::checkout;
 
-		if (argc!=3 || !strcmp(argv[2], "-h")) {
+		// Exactly one reference, optionally alongside a job count
+		for (int i = 2; i < argc; ++i) {
+			if (!strcmp(argv[i], "-h")) {
+				usage(argv[0], Command::checkout);
+			}
+			else if (!strcmp(argv[i], "--jobs") || !strcmp(argv[i], "-j")) {
+				if (++i == argc || !(jobs = jobCount(argv[i]))) {
+					usage(argv[0], Command::checkout);
+				}
+			}
+			else if (!strcmp(argv[i], "--incremental")) {
+				incremental = true;
+			}
+			else if (reference.size()) {
+				usage(argv[0], Command::checkout);
+			}
+			else {
+				reference = argv[i];
+			}
+		}
+
+		if (!reference.size()) {
 			usage(argv[0], Command::checkout);
 		}
 	}
+	else if (!strcmp(argv[1], "pack")) {
+		mode = Command::pack;
+
+		if (argc > 2) {
+			usage(argv[0], Command::pack);
+		}
+	}
 	else if (!strcmp(argv[1], "init")) {
 		mode = Command::init;
 
@@ -181,12 +346,7 @@ int main(int argc, char* argv[]) {
 		}
 		case Command::add:
 		{
-			std::vector<std::string> addFiles;
-			addFiles.reserve(argc - 2); // Reserve enough space for all files
-			for (int i = 2; i < argc; ++i) {
-				addFiles.emplace_back(argv[i]);
-			}
-			add(addFiles);
+			add(files, jobs ? jobs : ThreadPool::hardwareThreads()); // Adding is parallel by default
 			break;
 		}
 		case Command::commit:
@@ -201,7 +361,7 @@ int main(int argc, char* argv[]) {
 		}
 		case Command::log:
 		{
-			log();
+			log(logOptions);
 			break;
 		}
 		case Command::commitFiles:
@@ -214,9 +374,19 @@ int main(int argc, char* argv[]) {
 			commitFiles(addFiles);
 			break;
 		}
+		case Command::status:
+		{
+			status(jobs ? jobs : ThreadPool::hardwareThreads()); // Status hashes in parallel by default
+			break;
+		}
 		case Command::checkout:
 		{
-			checkout(argv[2]);
+			checkout(reference, jobs ? jobs : 1, incremental); // Checkout is serial by default
+			break;
+		}
+		case Command::pack:
+		{
+			pack();
 			break;
 		}
 		default:
@@ -241,12 +411,27 @@ void init() {
 	mkdir(REPOSITORY_PATH.c_str());
 	mkdir(repositoryPath("index"));
 	mkdir(repositoryPath("commits"));
+	mkdir(repositoryPath("objects"));
+	mkdir(repositoryPath("packs"));
 
 	std::ofstream indexmap(INDEXMAP_PATH);
 
+	// New repositories compress what they commit. The file is also where the rest of the configuration goes.
+	std::ofstream config(repositoryPath("config"));
+	config << "# Compress newly committed files with LZ4 at this level (1 to 9), or 0 to store them unmodified\n";
+	config << "compression 1\n";
+	config << "# Stage added files by copying them into the index (as reflinks where the filesystem can), or \"link\" to hard link them until they're committed\n";
+	config << "staging copy\n";
+	config.close();
+
 	// Make a plain initial commit marking repository creation
 	// First, the easy part.
-	std::stringstream commit; // Stores the growing commit in memory. Technically, we shouldn't do this, but... you know.
+	CommitWriter commit; // Streams the commit into the commits directory as it is written
+	if (!commit) {
+		removeDirectory(REPOSITORY_PATH);
+		std::cerr << "Could not initialize repository.\n";
+		exit(1);
+	}
 	commit << "COMMIT HEADER\n";
 	commit << "&&&\n";
 	commit << "parent 0\n";
@@ -273,71 +458,192 @@ void init() {
 	commit << "size 0\n";
 	commit << "&&&&&\n";
 
-	// Generate the hash of the commit
-	std::string contents = commit.str();
-	std::string hash = picosha2::hash256_hex_string(contents);
-
-	// And write to the commit file
-	std::ofstream file(repositoryPath("commits/" + hash));
-	if (!file) {
+	// Finally, move the commit to the file named by its hash
+	std::string hash = commit.finish();
+	if (hash == "") {
 		removeDirectory(REPOSITORY_PATH);
 		std::cerr << "Could not initialize repository.\n";
 		exit(1);
 	}
-	file.write(contents.c_str(), contents.size());
-	file.close();
 
 	// Write the HEAD marker
-	std::ofstream head(repositoryPath("HEAD"));
-	if (!head) {
+	if (!writeFileDurably(repositoryPath("HEAD").asStdString(), hash + "\n")) {
 		removeDirectory(REPOSITORY_PATH);
 		std::cerr << "Could not initialize repository.\n";
 		exit(1);
 	}
-	head << hash << "\n";
-	head.close();
+
+	// Start the commit graph off with the initial commit
+	CommitGraph graph;
+	std::string failed;
+	if (graph.update(hash, failed)) {
+		graph.save();
+	}
 
 	std::cout << "Initialized repository.\n";
 }
 
 // Next up, add.
-// Take the files in the provided vector, and copy them to the index
-void addFiles(const std::vector<std::string>& files, Indexmap& imap) {
-	std::string tmp;
+
+// The result of adding a single file: The hash of its contents, and the metadata to record along with it
+// The hash is empty if the file could not be copied.
+struct AddedFile {
 	std::string hash;
-	for (auto file : files) {
-		std::ifstream read(file);
-		if (!read) {
-			// If a provided file is not a file, then try to treat it as a directory
-			std::vector<std::string> f;
-			if (contentsOfDirectory(file, f)) {
-				std::cerr << "Error: Could not index file " << file << ".\n";
-
-				emptyDirectory(repositoryPath("index"));
-				std::cerr << "Index emptied.\n";
-				std::cerr << "Please re-add the appropriate files to the index.\n";
-
-				exit(2);
-			}
-
-			// Add all files in the directory.
-			// First, make sure that the paths get prepended to the filenames
-			// Then recurse with the newly filled vector.
-			if (file.back() != '/' && file.back() != '\\')
-				file += '/';
-			for (auto& fi : f) {
-				fi = file + fi;
-			}
-			addFiles(f, imap);
-			continue;
+	FileStat stat;
+};
+
+// Returns the metadata of a file created now, which carries the current time by the filesystem's own reckoning
+// A file modified in the same tick of that clock as it was hashed could change again without its metadata changing.
+// So metadata is only recorded for files last modified before the clock was read. If it can't be read, nothing is recorded.
+FileStat filesystemClock() {
+	FileStat clock;
+	std::string clockFile(repositoryPath("CLOCK"));
+	if (!std::ofstream(clockFile) || !statFile(clockFile, clock)) {
+		clock = FileStat();
+	}
+	remove(clockFile.c_str());
+	return clock;
+}
+
+// Take the files in the provided vector, and every file in the directories in it, and copy them to the index
+// Directories are walked while the files already found are hashed and copied, up to jobs at once. Repositories inside them are skipped,
+//   and so is anything the .heroignore matches, before it's even statted. Files named directly are always added.
+// Files whose metadata matches what was recorded when they were last added or committed are assumed unchanged, and are not read at all.
+// The Indexmap is only updated once every file has been copied.
+void addFiles(const std::vector<std::string>& files, Indexmap& imap, size_t jobs) {
+	// Files with identical contents share an index entry, so only the first worker to find a hash keeps its copy.
+	std::mutex lock;
+	std::set<std::string> copied;
+	std::set<std::string> shared; // Contents staged for more than one path, in this add or an earlier one
+	PackSet packs;
+	IndexTable cache(repositoryPath(STATCACHE_PATH).asStdString());
+
+	FileStat clock(filesystemClock());
+	bool link(Config().get("staging") == "link");
+
+	ThreadPool pool(jobs);
+	std::deque<std::string> paths; // Paths stay where they are as more are found, so workers can refer to them
+	std::vector<std::future<AddedFile>> added;
+	IgnoreRules ignore;
+	auto include = [&ignore](const std::string& path, FileType type) {
+		return !ignore.ignored(path, type == FileType::directory);
+	};
+	auto addFile = [&](const std::string& path, FileType type, const FileStat& stat) {
+		if (type == FileType::directory) {
+			size_t slash(path.find_last_of("/\\"));
+			return path.substr(slash == std::string::npos ? 0 : slash + 1) != REPOSITORY_PATH;
 		}
 
-		hash = picosha2::hash256_hex_string(read);
-		read.close();
-		imap[file] = hash;
-		tmp = repositoryPath("index/" + hash);
-		if (!copyfile(file.c_str(), tmp.c_str())) {
-			std::cerr << "Error: Could not copy file " << file << ".\n";
+		// The walk has already read the metadata of the file
+		size_t i(paths.size());
+		paths.push_back(path);
+		const std::string& file(paths.back());
+		added.push_back(pool.submit([&lock, &copied, &shared, &packs, &cache, &imap, &clock, &file, link, stat, i]() {
+			AddedFile result;
+			result.stat = (stat.mtime < clock.mtime) ? stat : FileStat();
+
+			// An unchanged file already in the index needs nothing done, and one unchanged since it was committed is already stored
+			IndexEntry entry;
+			if (imap.getEntry(file, entry) && entry.matches(result.stat)) {
+				result.hash = entry.hash;
+				return result;
+			}
+			if (cache.find(file, entry) && entry.matches(result.stat) && packs.hasObject(entry.hash)) {
+				result.hash = entry.hash;
+				return result;
+			}
+
+			// Each file is read once: It's hashed while it's copied to a temporary name (or reflinked, where the filesystem allows), then renamed to its hash.
+			// That way, the hash always describes exactly the bytes in the index, even if the file changes meanwhile.
+			// The metadata was read first, so a change made meanwhile leaves it stale, and the file will be read again next time.
+			// If staging is set to link, the file is hard linked instead, unless it's on another filesystem.
+			std::string tmp(repositoryPath("index/ADD_PARTIAL_" + std::to_string(i)));
+			remove(tmp.c_str()); // A copy left by an earlier add could be linked to a file, which mustn't be overwritten
+			result.hash = link ? hashedLink(file, tmp) : "";
+			if (result.hash == "") {
+				result.hash = hashedCopy(file, tmp);
+			}
+			if (result.hash == "") {
+				remove(tmp.c_str());
+				return result;
+			}
+
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				if (!copied.insert(result.hash).second) {
+					shared.insert(result.hash);
+					remove(tmp.c_str());
+					return result;
+				}
+			}
+
+			// Contents which an earlier commit already stored don't need to be kept in the index at all
+			if (packs.hasObject(result.hash)) {
+				remove(tmp.c_str());
+				return result;
+			}
+
+			std::string target(repositoryPath("index/" + result.hash));
+			if (std::ifstream(target)) { // Staged by an earlier add, for this path or another
+				std::lock_guard<std::mutex> guard(lock);
+				shared.insert(result.hash);
+			}
+			remove(target.c_str()); // rename does not replace existing files everywhere, and an existing file has the same contents
+			if (rename(tmp.c_str(), target.c_str())) {
+				remove(tmp.c_str());
+				result.hash.clear();
+			}
+			return result;
+		}));
+		return true;
+	};
+
+	std::string unreadable;
+	for (const auto& file : files) {
+		if (walkTree(file, include, addFile)) {
+			unreadable = file;
+			break;
+		}
+	}
+
+	// Wait for every file before touching the Indexmap, so a failure leaves it as it was
+	std::vector<AddedFile> results;
+	results.reserve(paths.size());
+	for (auto& file : added) {
+		results.push_back(file.get());
+	}
+
+	if (unreadable.size()) {
+		std::cerr << "Error: Could not index file " << unreadable << ".\n";
+
+		emptyDirectory(repositoryPath("index"));
+		std::cerr << "Index emptied.\n";
+		std::cerr << "Please re-add the appropriate files to the index.\n";
+
+		exit(2);
+	}
+
+	// A hard link is the one file it was made from, so contents staged for several paths can't stay linked to any of them:
+	//   Editing that file before commit would change what's staged for the rest too. They get a copy of their own instead.
+	// If the contents no longer match their hash, the file was changed after it was added, and what the others staged is gone.
+	for (const auto& hash : shared) {
+		std::string target(repositoryPath("index/" + hash));
+		if (linkCount(target) > 1) {
+			std::string partial(target + ".partial");
+			if (hashedCopy(target, partial) != hash || rename(partial.c_str(), target.c_str())) {
+				remove(partial.c_str());
+				for (size_t i = 0; i < paths.size(); ++i) {
+					if (results[i].hash == hash) {
+						results[i].hash.clear();
+					}
+				}
+			}
+		}
+	}
+
+	for (size_t i = 0; i < paths.size(); ++i) {
+		if (results[i].hash == "") {
+			std::cerr << "Error: Could not copy file " << paths[i] << ".\n";
 
 			emptyDirectory(repositoryPath("index"));
 			std::cerr << "Index emptied.\n";
@@ -346,21 +652,76 @@ void addFiles(const std::vector<std::string>& files, Indexmap& imap) {
 			exit(1);
 		}
 	}
+
+	for (size_t i = 0; i < paths.size(); ++i) {
+		imap.set(paths[i], results[i].hash, results[i].stat);
+	}
 }
 
 // Master command for addFiles - Set up the Indexmap, and print out a success message.
-void add(const std::vector<std::string>& files) {
+void add(const std::vector<std::string>& files, size_t jobs) {
 	IndexmapLoader imap_ldr;
 	Indexmap& imap(imap_ldr.map);
 
-	addFiles(files, imap);
+	addFiles(files, imap, jobs);
 
 	std::cout << "All files added to index.\n";
 }
 
-// Copy the files in the index into a commit file in the commits folder
+// Returns the encoding of the loose object with the given hash, or an empty string if it is stored unmodified or packed
+std::string looseEncoding(const std::string& hash) {
+	return std::ifstream(objectPath(hash, encoding::LZ4)) ? encoding::LZ4 : "";
+}
+
+// Moves the indexed file into the object store as the object with the given hash
+// If level is above 0 and the contents look compressible, they're compressed on the way, and kept that way if it makes them smaller.
+// Otherwise, the file is just renamed.
+// A file staged as a hard link is still the working file, which may change (or be truncated) at any moment, so it's never read in place:
+//   Its contents are first copied out and checked against the hash, and only that copy is compressed or renamed into the store.
+// Sets stored to the encoding the object was stored with
+// Returns whether the object could be stored
+bool storeObject(const std::string& indexed, const std::string& hash, int level, std::string& stored) {
+	stored.clear();
+	std::string object(objectPath(hash).asStdString());
+	std::string source(indexed);
+	bool linked(linkCount(indexed) > 1);
+	if (linked) {
+		source = object + ".partial";
+		if (hashedCopy(indexed, source) != hash) {
+			remove(source.c_str());
+			return false;
+		}
+	}
+
+	if (level > 0) {
+		MappedFile contents(source);
+		if (contents && encoding::worthCompressing(contents.data(), contents.size())) {
+			std::string compressed(objectPath(hash, encoding::LZ4));
+			std::string partial(compressed + ".partial");
+			std::ofstream out(partial, std::ios::out | std::ios::binary | std::ios::trunc);
+			uint64_t written(encoding::encode(contents.data(), contents.size(), out, level));
+			out.close();
+			if (out && written && written < contents.size() && !rename(partial.c_str(), compressed.c_str())) {
+				stored = encoding::LZ4;
+			}
+			remove(partial.c_str());
+		}
+	}
+
+	bool good(stored.size() || !rename(source.c_str(), object.c_str()));
+	if (stored.size() || !good) {
+		remove(source.c_str()); // Only a copy, if the indexed file was linked
+	}
+	if (good && linked) {
+		remove(indexed.c_str());
+	}
+	return good;
+}
+
+// Move the indexed copies of the files in cmap into the object store, and write a commit file referencing them in the commits folder
 // This file will have its SHA256 as its filename, and will have formatting compatible with the format specified in commit-blob.txt
-void commit() {
+// HEAD is moved to the new commit. The files stay in cmap, and anything else in the index is left alone.
+void commitMap(const Commitmap& cmap) {
 	bool detached(false);
 	std::string parent(getHeadHash());
 	if (parent == "") {
@@ -391,7 +752,11 @@ void commit() {
 
 	std::string title; // Commit title
 	std::string message; // Commit message
-	std::stringstream commit; // Stores the growing commit in memory. Technically, we shouldn't do this, but... you know.
+	CommitWriter commit; // Streams the commit into the commits directory as it is written
+	if (!commit) {
+		std::cerr << "Could not create commit.\n";
+		exit(1);
+	}
 	commit << "COMMIT HEADER\n";
 	commit << "&&&\n";
 
@@ -431,10 +796,7 @@ void commit() {
 	// The commit process can take some time, so we don't want the user to wonder if they need to enter ^x again
 	std::cout << "Creating new commit \'" << title << "\'..." << std::endl;
 
-	// Now, get the list of files in the index, and add their names to the commit header.
-	CommitmapLoader cmap_ldr;
-	Commitmap& cmap(cmap_ldr.map);
-
+	// Now, add the names of the files to the commit header.
 	commit << "files [";
 	for (const auto& pair : cmap) {
 		commit << pair.second << ",";
@@ -445,7 +807,11 @@ void commit() {
 	commit << "&&&&&\n";
 
 	// Now, loop over the files
-	size_t totalSize(0); // Tracks the size of all files, for the footer.
+	uint64_t totalSize(0); // Tracks the size of all files, for the footer.
+	mkdir(repositoryPath("objects")); // Repositories made before the object store existed won't have it yet
+	PackSet packs; // Files which haven't changed since they were last committed may have been packed since
+	int level((int)Config().getNumber("compression", 0));
+	std::vector<std::string> objects; // Stored by this commit, and so not yet known to be on disk
 	for (const auto& pair : cmap) {
 		const Commitmap::Hash& index(pair.first);
 		const Commitmap::Filename& disk(pair.second);
@@ -454,67 +820,106 @@ void commit() {
 		commit << disk << "\n";
 
 		// Now, open the file
-		std::ifstream ifs(repositoryPath("index/" + index), std::ios::binary);
-
-		// Now, write the hash of the file.
-		// We distrust the indexmap, just in case it's been modified (for some reason):
-		//   We want the commit's file hash to always match the hash of the data in the file.
-		// It's a data integrity thing. That is, after all, the point of writing the hash.
-		auto hash = picosha2::hash256_hex_string(ifs);
-		if (hash != index) {
-			std::cout << "Indexed file " << disk << " has a hash mismatch.\n"
-				<< "  Hash at add time was: " << index << "\n"
-				<< "  Hash at commit time is: " << hash << "\n"
-				<< "Some data may have been corrupted.\n\n";
-		}
-		commit << "checksum " << hash << "\n";
+		// If its contents were already in the object store when it was added, the index holds no copy of it.
+		std::string indexed(repositoryPath("index/" + index));
+		std::ifstream ifs(indexed, std::ios::binary);
+		std::string hash;
+		std::string stored; // The encoding of the object
+		uint64_t size;
+		if (ifs) {
+			// Now, write the hash of the file.
+			// We distrust the indexmap, just in case it's been modified (for some reason):
+			//   We want the commit's file hash to always match the hash of the data in the file.
+			// It's a data integrity thing. That is, after all, the point of writing the hash.
+			// A file staged as a hard link is the working file itself, so it's expected to change if it's edited after it's added.
+			hash = hashOfFile(ifs);
+			if (hash != index && linkCount(indexed) > 1) {
+				std::cout << "File " << disk << " has changed since it was added.\n"
+					<< "  It will be committed as it is now.\n\n";
+			}
+			else if (hash != index) {
+				std::cout << "Indexed file " << disk << " has a hash mismatch.\n"
+					<< "  Hash at add time was: " << index << "\n"
+					<< "  Hash at commit time is: " << hash << "\n"
+					<< "Some data may have been corrupted.\n\n";
+			}
 
-		// Now, get and write the size of the file
-		ifs.seekg(0, ifs.end);
-		size_t size(ifs.tellg());
-		ifs.seekg(0, ifs.beg); // Restore read pointer to the beginning
-		totalSize += size;
-		commit << "size " << size << "\n";
+			// Now, get the size of the file
+			ifs.seekg(0, ifs.end);
+			size = ifs.tellg();
+			ifs.close();
 
-		// End file header
-		commit << "&&&\n";
+			// Move the file into the object store, under the hash of what it actually holds.
+			// If the store already has those contents, this copy is redundant.
+			if (packs.hasObject(hash)) {
+				remove(indexed.c_str());
+				stored = looseEncoding(hash);
+			}
+			else if (!storeObject(indexed, hash, level, stored)) {
+				std::cerr << "Could not move indexed file " << disk << " into the object store.\n";
+				exit(1);
+			}
+			else {
+				objects.push_back(objectPath(hash, stored).asStdString());
+			}
+		}
+		else {
+			if (!packs.objectSize(index, size)) {
+				std::cerr << "Indexed file " << disk << " is missing from both the index and the object store.\n";
+				exit(1);
+			}
+			hash = index;
+			stored = looseEncoding(hash);
+		}
+		totalSize += size;
 
-		// Now, the file contents
-		char* buf(new char[size]); // Buffer for reading
-		ifs.read(buf, size); // Read into the buffer
-		commit.write(buf, size); // And write into the commit
-		delete[] buf;
+		// Write the hash and size of the file, and how its contents are stored
+		commit << "checksum " << hash << "\n";
+		commit << "size " << size << "\n";
+		if (stored.size()) {
+			commit << "encoding " << stored << "\n";
+		}
 
-		// Mark the file as ended
+		// The contents live in the object store, so the file ends with its header
 		commit << "&&&&&\n";
-
-		// Remove the file from the index
-		remove(repositoryPath("index/" + index));
+		commit.addObject(disk, hash, size, stored); // Record the file for the commit's sidecar index
 	}
 
 	// Finally, the commit footer
+	commit.markFooter();
 	commit << "COMMIT FOOTER\n";
 	commit << "&&&\n";
 	commit << "count " << cmap.size() << "\n";
 	commit << "size " << totalSize << "\n";
 	commit << "&&&&&\n";
 
-	// Finally, write the commit to disk and empty the index
-	// First, generate the hash of the commit
-	std::string contents = commit.str();
-	std::string hash = picosha2::hash256_hex_string(contents);
+	// Every object the commit refers to must be on disk before the commit is. They're flushed all at once, rather than one by one.
+	if (!syncFiles(objects) || !syncFiles(objects, true)) {
+		std::cerr << "Could not create commit.\n";
+		exit(1);
+	}
 
-	// And write to the commit file
-	std::ofstream file(repositoryPath("commits/" + hash), std::ios::binary);
-	if (!file) {
+	// Finally, move the commit to the file named by its hash and empty the index
+	std::string hash = commit.finish();
+	if (hash == "") {
 		std::cerr << "Could not create commit.\n";
 		exit(1);
 	}
-	file.write(contents.c_str(), contents.size());
-	file.close();
 
-	// Now, clear the indexmap (the file on disk will be truncated at end-of-scope)
-	cmap.clear();
+	// Add the commit to the commit graph, so log doesn't have to read it
+	// The graph can always be rebuilt from the commits, so failing to update it isn't fatal.
+	CommitGraph graph;
+	std::string failed;
+	if (graph.update(hash, failed)) {
+		graph.save();
+	}
+
+	// Remember the metadata of everything committed, so files which haven't changed since can be added again without reading them
+	IndexTable cache(repositoryPath(STATCACHE_PATH).asStdString());
+	cmap.table().forEach([&cache](const Commitmap::Filename& path, const IndexEntry& entry) {
+		cache.set(path, entry.hash, entry.stat);
+	});
+	cache.save(repositoryPath(STATCACHE_PATH).asStdString());
 
 	// If we're in a detached state, warn about not updating HEAD and print our hash
 	if (detached) {
@@ -523,17 +928,23 @@ void commit() {
 		std::cerr << hash << "\n";
 	}
 	// Else, update the HEAD marker to match this commit
-	else {
-		std::ofstream head(repositoryPath("HEAD"), std::ios::trunc);
-		if (!head) {
-			remove(repositoryPath("commits/" + hash));
-			std::cerr << "Could not create commit.\n";
-			exit(2);
-		}
-		head << hash << "\n";
-		head.close();
+	// HEAD is replaced in one step, so a crash leaves it naming either the old commit or this one.
+	else if (!writeFileDurably(repositoryPath("HEAD").asStdString(), hash + "\n")) {
+		remove(repositoryPath("commits/" + hash));
+		std::cerr << "Could not create commit.\n";
+		exit(2);
 	}
+}
+
+// Commit everything in the index, then empty it
+void commit() {
+	CommitmapLoader cmap_ldr;
+	Commitmap& cmap(cmap_ldr.map);
 
+	commitMap(cmap);
+
+	// Now, clear the indexmap (the file on disk will be truncated at end-of-scope)
+	cmap.clear();
 	emptyDirectory(repositoryPath("index"));
 
 	// Confirm to the user that we succeeded
@@ -544,33 +955,17 @@ void commit() {
 // That is, reads the HEAD commit, lists the files named there into a vector...
 // Passes that vector into add, and then calls commit
 void commitLast() {
-	std::string line(getHeadHash());
-	std::ifstream last(repositoryPath("commits/"+line));
+	CommitReader last(getHeadHash());
 	if (!last) {
 		std::cerr << "Could not access last commit.\n";
 		exit(1);
 	}
-	std::stringstream filestream;
-	std::vector<std::string> files;
-
-	do {
-		std::getline(last, line);
-	} while (line.find("files [")!=0);
-	last.close();
-
-	// 7 is the first character after "files [", plus one for the ending ']'
-	filestream<<line.substr(7, line.size() - 8);
 
-	// Read all entries, using the stream as parser, into the vector
-	while (true) {
-		std::getline(filestream, line, ',');
-		if (filestream.eof())
-			break;
-		files.emplace_back(line);
-	}
+	// The commit header lists every file in the commit, so we don't need to look at the files themselves
+	std::vector<std::string> files(last.listedFiles());
 
 	// Finally, we can add these files to the index.
-	add(files);
+	add(files, ThreadPool::hardwareThreads());
 	// And then commit.
 	commit();
 }
@@ -578,126 +973,716 @@ void commitLast() {
 // Handles commit with a list of files
 // Has the semantics that all files listed are committed, and no other
 // The index is preserved as it was, except that files present in the index and command line are removed from the index
+// The listed files are added to a map of their own, held in memory, and that map is committed, so the rest of the index is never copied.
+// Their indexed copies live in the index directory alongside the rest, which is safe since copies are named by their contents:
+//   If committing one moves contents something else in the index still refers to into the object store, commit finds them there instead.
 void commitFiles(const std::vector<std::string>& files) {
-	removeDirectory(repositoryPath("indexCopy")); // Just in case
+	Indexmap selection;
+	addFiles(files, selection, ThreadPool::hardwareThreads());
+
+	commitMap(Commitmap(selection));
+
+	// Drop the committed files from the index, along with the copies of what was staged for them, if nothing else refers to those
+	IndexmapLoader imap_ldr;
+	Indexmap& imap(imap_ldr.map);
+	std::set<Indexmap::Hash> dropped;
+	selection.table().forEach([&imap, &dropped](const Indexmap::Filename& path, const IndexEntry&) {
+		IndexEntry staged;
+		if (imap.getEntry(path, staged)) {
+			imap.erase(path);
+			dropped.insert(staged.hash);
+		}
+	});
+	for (const auto& hash : dropped) {
+		if (imap.getFile(hash) == "") {
+			remove(repositoryPath("index/" + hash));
+		}
+	}
+
+	std::cout << "Done.\n";
+}
+
+// Returns a title or message as it was written, undoing the escaping applied when it was stored in a commit
+std::string unescaped(const std::string& text) {
+	return escaped(escaped(text, "/amp;", "&"), "/sl;", "/");
+}
+
+// Produces a log of the commit history by the commit headers
+// History is read from the commit graph. Any commits missing from it are read from their commits, then added to it.
+// Commits are only decoded as far as the options need: Messages are only unescaped for commits which are printed,
+//   and the walk stops as soon as the limit is reached, or it passes the earliest time asked for.
+void log(const LogOptions& options) {
+	std::string hash(getHeadHash());
 
-	// Back up the index
-	if (!copyDirectory(repositoryPath("index"), repositoryPath("indexCopy"))) { 
-		std::cerr << "Could not back up repository index.\n";
+	CommitGraph graph;
+	std::string failed;
+	if (!graph.update(hash, failed)) {
+		std::cerr << "Could not access commit " << failed << "\n";
 		exit(1);
 	}
 
-	// If INDEXMAP_PATH doesn't start with index/, our prior copy didn't get it, so we have to do it ourselves.
-	if (INDEXMAP_PATH.find("index/")) {
-		if (!copyfile(repositoryPath(INDEXMAP_PATH), repositoryPath("indexCopy/" + INDEXMAP_PATH))) {
-			std::cerr << "Could not back up repository index.\n";
-			exit(1);
+	size_t shown(0);
+	for (size_t i = graph.find(hash); i != CommitGraph::NONE && (!options.limit || shown < options.limit); i = graph.parent(i)) {
+		int64_t time(graph.time(i));
+		if (time < options.since) {
+			break;
 		}
+		if (time > options.until) {
+			continue;
+		}
+
+		std::string title(unescaped(graph.title(i)));
+		if (options.grep.size() && title.find(options.grep) == std::string::npos) {
+			continue;
+		}
+		++shown;
+
+		if (options.oneline) {
+			std::cout << graph.abbreviate(graph.hash(i)) << " " << title << "\n";
+			continue;
+		}
+
+		std::cout << "commit " << graph.hash(i) << "\n";
+
+		// The date and time
+		std::cout << "Committed on " << commitDate(time);
+		std::cout << " at " << commitTime(time) << "\n";
+
+		// The title
+		std::cout << "\t" << title << "\n\n";
+
+		// And finally the message
+		std::string message(escaped(unescaped(graph.message(i)), "\n", "\n\t")); // Indent every line of the commit message
+		std::cout << "\t" << message << "\n\n";
 	}
 
-	// Empty the index entirely
-	emptyDirectory(repositoryPath("index"));
+	// Keep whatever had to be read from commits for next time
+	graph.save();
+}
+
+// Returns the SHA256 of the file at filename in the working directory, or an empty string if there is no such file
+std::string hashOfWorkingFile(const std::string& filename) {
+	std::ifstream file(filename, std::ios::binary);
+	if (!file) {
+		return "";
+	}
+	return hashOfFile(file);
+}
+
+// What status knows about a single tracked file
+struct StatusEntry {
+	std::string path; // The path of the file in the working directory
+	std::string committed; // The hash of the file in the checked out commit, or empty if it isn't there
+	std::string indexed; // The hash of the file in the index, or empty if it hasn't been added
+	std::string working; // The hash of the file on disk, once known, or empty if it's missing
+	FileStat stat; // The metadata of the file on disk
+	bool suspect; // Whether the file has to be hashed to know whether it changed
+
+	StatusEntry() : suspect(false) {}
+
+	// The hash the file on disk should have if it hasn't changed
+	const std::string& expected() const {
+		return indexed.size() ? indexed : committed;
+	}
+};
+
+// Prints a heading, then each change in order of path
+void printChanges(const std::string& heading, std::vector<std::pair<std::string, const char*>>& changes) {
+	if (changes.empty()) {
+		return;
+	}
+	std::sort(changes.begin(), changes.end());
+	std::cout << "\n" << heading << "\n";
+	for (const auto& change : changes) {
+		std::cout << "\t" << change.second << change.first << "\n";
+	}
+}
+
+// Reports how the index and the working directory differ from the checked out commit
+// Files in the index are compared against what was added, and every other file against what was committed.
+// Only the table of files is read from the commit. Files whose metadata matches what was recorded when they were
+//   last added or committed are assumed unchanged. Only the rest are read, up to jobs at once.
+// Files found unchanged that way have their metadata recorded in the stat cache, so the next status won't read them.
+// Files in neither the commit nor the index are listed as untracked, unless they're ignored. Finding them only reads directories.
+void status(size_t jobs) {
+	std::string head(getHeadHash());
+	if (head == "") {
+		std::cerr << "Could not find repository head - have you run init?\n";
+		exit(1);
+	}
+
+	std::string hash(head);
+	if (std::ifstream lock = std::ifstream(repositoryPath("COMMIT_LOCK"), std::ios::binary)) {
+		std::getline(lock, hash);
+	}
+
+	CommitReader commit(hash);
+	if (!commit) {
+		std::cerr << "Could not access commit " << hash << "\n";
+		exit(1);
+	}
 
+	// Every committed file, in the order the commit lists them, followed by the files only in the index
+	// The index is usually small, so it's searched for each committed file rather than the other way around.
+	Indexmap imap(Indexmap::loadFrom(repositoryPath(INDEXMAP_PATH).asStdString()));
+	commit.files(); // Building the file table reads the whole commit, so it can only be found malformed now
+	if (!commit) {
+		std::cerr << "Commit " << hash << " is malformed.\n";
+		exit(1);
+	}
+	std::vector<StatusEntry> files(commit.files().size());
+	std::set<std::string> matched;
+	bool indexEmpty(imap.empty());
+	for (size_t i = 0; i < files.size(); ++i) {
+		const CommitEntry& entry(commit.files()[i]);
+		files[i].path = entry.path;
+		files[i].committed = entry.checksum;
+		if (!indexEmpty && (files[i].indexed = imap.getHash(entry.path)).size()) {
+			matched.insert(entry.path);
+		}
+	}
+	imap.table().forEach([&files, &matched](const Indexmap::Filename& path, const IndexEntry& entry) {
+		if (!matched.count(path)) {
+			files.emplace_back();
+			files.back().path = path;
+			files.back().indexed = entry.hash;
+		}
+	});
+
+	// Stat every file, and compare it against the metadata recorded along with the hash it's expected to have
+	// Statting is split into one slice per job, since most of its time is spent waiting on the filesystem.
+	IndexTable cache(repositoryPath(STATCACHE_PATH).asStdString());
+	{
+		ThreadPool pool(jobs);
+		std::vector<std::future<void>> slices;
+		size_t slice((files.size() + jobs - 1) / jobs);
+		for (size_t start = 0; start < files.size(); start += slice) {
+			slices.push_back(pool.submit([&files, &imap, &cache, start, slice]() {
+				for (size_t i = start; i < files.size() && i < start + slice; ++i) {
+					StatusEntry& file(files[i]);
+					if (!statFile(file.path, file.stat)) {
+						continue;
+					}
+
+					IndexEntry recorded;
+					bool known(file.indexed.size() ? imap.getEntry(file.path, recorded) : cache.find(file.path, recorded));
+					if (known && recorded.hash == file.expected() && recorded.matches(file.stat)) {
+						file.working = file.expected();
+					}
+					else {
+						file.suspect = true;
+					}
+				}
+			}));
+		}
+		for (auto& slice : slices) {
+			slice.get();
+		}
+	}
+
+	// Hash every file which might have changed
+	std::vector<StatusEntry*> suspects;
+	for (auto& file : files) {
+		if (file.suspect) {
+			suspects.push_back(&file);
+		}
+	}
+	{
+		ThreadPool pool(jobs);
+		std::vector<std::future<std::string>> hashes;
+		hashes.reserve(suspects.size());
+		for (auto file : suspects) {
+			const std::string& path(file->path);
+			hashes.push_back(pool.submit([&path]() { return hashOfWorkingFile(path); }));
+		}
+		for (size_t i = 0; i < suspects.size(); ++i) {
+			suspects[i]->working = hashes[i].get();
+		}
+	}
+
+	// Remember the metadata of committed files found unchanged, unless they changed too recently for it to be trusted
+	FileStat clock(filesystemClock());
+	bool refreshed(false);
+	for (auto file : suspects) {
+		if (file->working.size() && file->working == file->committed && file->stat.mtime < clock.mtime) {
+			cache.set(file->path, file->working, file->stat);
+			refreshed = true;
+		}
+	}
+	if (refreshed) {
+		cache.save(repositoryPath(STATCACHE_PATH).asStdString());
+	}
+
+	// Walk the working directory for files which aren't tracked, skipping whatever the .heroignore matches
+	// Only their names are needed, so each file is looked up as soon as the walk finds it, and never statted.
+	std::vector<const char*> tracked;
+	tracked.reserve(files.size());
 	for (const auto& file : files) {
-		remove(repositoryPath("indexCopy/"+file)); // Make sure the file to be committed is removed from the copied index
+		const char* path(file.path.c_str());
+		while (!strncmp(path, "./", 2)) { // The walk names files without it
+			path += 2;
+		}
+		tracked.push_back(path);
+	}
+	auto before = [](const char* a, const char* b) { return strcmp(a, b) < 0; };
+	std::sort(tracked.begin(), tracked.end(), before);
+
+	IgnoreRules ignore;
+	std::vector<std::pair<std::string, const char*>> untracked;
+	auto untrackedFile = [&tracked, &before, &ignore, &untracked](const std::string& path, FileType type) {
+		if (type == FileType::directory) {
+			size_t slash(path.find_last_of("/\\"));
+			return path.substr(slash == std::string::npos ? 0 : slash + 1) != REPOSITORY_PATH && !ignore.ignored(path, true);
+		}
+		if (!std::binary_search(tracked.begin(), tracked.end(), path.c_str(), before) && !ignore.ignored(path, false)) {
+			untracked.emplace_back(path, "");
+		}
+		return false; // Files are never visited, so the walk never stats them
+	};
+	if (walkTree(".", untrackedFile, [](const std::string&, FileType, const FileStat&) { return true; })) {
+		std::cerr << "Warning: Could not read the whole working directory, so some untracked files may not be listed.\n";
 	}
 
-	// Add all commandline files
-	add(files);
-	// And then commit.
-	commit();
+	std::vector<std::pair<std::string, const char*>> staged;
+	std::vector<std::pair<std::string, const char*>> unstaged;
+	for (const auto& file : files) {
+		if (file.indexed.size() && file.indexed != file.committed) {
+			staged.emplace_back(file.path, file.committed.size() ? "modified: " : "added:    ");
+		}
+		if (file.working != file.expected()) {
+			unstaged.emplace_back(file.path, file.working.size() ? "modified: " : "deleted:  ");
+		}
+	}
+
+	if (hash == head) {
+		std::cout << "On commit " << hash << " (HEAD)\n";
+	}
+	else {
+		std::cout << "On commit " << hash << ", which is not HEAD " << head << "\n";
+	}
+	printChanges("Changes in the index:", staged);
+	printChanges("Changes not in the index:", unstaged);
+	printChanges("Untracked files:", untracked);
+	if (staged.empty() && unstaged.empty() && untracked.empty()) {
+		std::cout << "Nothing has changed.\n";
+	}
+}
 
-	removeDirectory(repositoryPath("index"));
-	// Restore the index, minus duplicated files
-	if (!copyDirectory(repositoryPath("indexCopy"), repositoryPath("index"))) {
-		std::cerr << "Could not restore index.\n";
-		removeDirectory(repositoryPath("indexCopy"));
-		if (mkdir(repositoryPath("index")) && errno != EEXIST) {
-			std::cerr << "Also could not create index directory.\n";
-			std::cerr << "Please ensure that the \""+REPOSITORY_PATH+"\" directory is writable...\n";
-			std::cerr << "Then create a folder named \"index\" inside it before running \"add\" or \"commit\".\n";
-			exit(errno);
+// Makes sure every directory leading up to filename exists
+void makeParentDirectories(const std::string& filename) {
+	// If the filename includes a directory mark, we need to go through it and make sure the directory exists before performing checkout.
+	if (filename.find('/')!=std::string::npos || filename.find('\\') != std::string::npos) {
+		// Split the path into a list of directories
+		std::vector<std::string> parts;
+		if (filename.find("/"))
+			parts = split(filename, '/');
+		else
+			parts = split(filename, '\\');
+
+		// And then make all those directories (except the last one, which is a filename)
+		std::string path;
+		for (size_t i = 0; i < parts.size() - 1; ++i) {
+			path += parts[i] + '/';
+			mkdir(path.c_str());
 		}
-		else {
-			std::cerr << "The index has been emptied.\n";
-			exit(2);
+	}
+}
+
+// Writes size bytes from data to a new file at filename, replacing any file there
+// Returns whether the file could be written
+bool writeFile(const std::string& filename, const char* data, uint64_t size) {
+	std::ofstream file(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+	file.write(data, size);
+	file.close();
+	return bool(file);
+}
+
+// Returns the name a file is written under while it's checked out, before it replaces the file at filename
+std::string partialPath(const std::string& filename) {
+	return filename + ".HERO_PARTIAL";
+}
+
+// Writes the contents described by entry out to target from their compressed object, decompressing them as they're written
+// Sets hash to the SHA256 of the contents which were written
+// Returns false if there is no compressed object for the contents, or it could not be decompressed and written
+bool unpackCompressed(const CommitEntry& entry, const std::string& target, std::string& hash) {
+	std::ifstream object(objectPath(entry.checksum, encoding::LZ4), std::ios::in | std::ios::binary);
+	if (!object) {
+		return false;
+	}
+
+	std::ofstream file(target, std::ios::out | std::ios::binary | std::ios::trunc);
+	Hasher hasher;
+	bool decoded(encoding::decode(object, [&file, &hasher](const char* data, size_t size) {
+		file.write(data, size);
+		hasher.update(data, size);
+	}));
+	file.close();
+	if (!decoded || !file) {
+		return false;
+	}
+
+	hash = hasher.hexDigest();
+	return true;
+}
+
+// Writes the file described by entry out to target, beside where it belongs in the working directory, from commit, whose blob is mapped as blob
+// Files in the object store are written from a mapping of their object instead, or decompressed from it, or read out of whichever pack holds them.
+// Sets hash to the SHA256 of the contents which were written
+// If the commit or object could not be mapped, falls back to copying through a stream and hashing the written file
+// Returns whether the file could be written
+bool unpackFile(CommitReader& commit, const MappedFile& blob, const PackSet& packs, const CommitEntry& entry, const std::string& target, std::string& hash) {
+	makeParentDirectories(entry.path);
+
+	if (entry.embedded && blob) {
+		if (!blob.writeRange(entry.offset, entry.size, target.c_str())) {
+			return false;
 		}
+
+		// The bytes we wrote are the mapped bytes, so hashing them avoids reading the file back
+		hash = hashOfBuffer(blob.data() + entry.offset, entry.size);
+		return true;
 	}
+	if (!entry.embedded) {
+		// The encoding in the commit says how the object was first stored, but packing may since have moved it
+		if (entry.encoding == encoding::LZ4 && unpackCompressed(entry, target, hash)) {
+			return true;
+		}
+
+		MappedFile object(objectPath(entry.checksum).asStdString());
+		if (object) {
+			if (!object.writeRange(0, object.size(), target.c_str())) {
+				return false;
+			}
+			hash = hashOfBuffer(object.data(), object.size());
+			return true;
+		}
 
-	// Restore the Indexmap if we backed it up separately
-	if (INDEXMAP_PATH.find("index/")) {
-		if (!copyfile(repositoryPath("indexCopy/" + INDEXMAP_PATH), repositoryPath(INDEXMAP_PATH))) {
-			std::cerr << "Could not restore index.\n";
-			exit(3);
+		const PackReader* pack(packs.find(entry.checksum));
+		const char* data;
+		uint64_t size;
+		std::string scratch; // Holds the object if it has to be rebuilt from a delta
+		if (pack && pack->view(entry.checksum, data, size, scratch)) {
+			if (!writeFile(target, data, size)) {
+				return false;
+			}
+			hash = hashOfBuffer(data, size);
+			return true;
 		}
 	}
-	removeDirectory(repositoryPath("indexCopy"));
+
+	std::fstream file(target, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!file || !commit.copyTo(entry, file)) {
+		return false;
+	}
+
+	file.seekg(0, std::ios::beg);
+	hash = hashOfFile(file);
+	return true;
 }
 
-// Produces a log of the commit history by the commit headers
-void log() {
-	std::string hash(getHeadHash());
-	std::ifstream commit;
+// Resolves a reference given on the commandline to the hash of the commit it names
+// A reference is HEAD, a hash, or the start of one which no other commit shares, optionally followed by ~N to go back N generations.
+// Hashes are looked up in both the commit graph and the commits directory, since commits made before the graph existed are only in the directory.
+//   Only commits which are actually in the directory count, so a graph which is out of date can't name a commit which is gone.
+// Exits with an error if the reference does not name exactly one commit
+std::string resolveReference(const std::string& reference) {
+	std::string name(reference);
+	size_t generations(0);
+	size_t tilde(reference.find('~'));
+	if (tilde != std::string::npos) {
+		name = reference.substr(0, tilde);
+		std::string count(reference.substr(tilde + 1));
+		if (!std::all_of(count.begin(), count.end(), [](char c) { return isdigit((unsigned char)c) != 0; })) {
+			std::cerr << "Invalid reference " << reference << "\n";
+			exit(1);
+		}
+		generations = count.size() ? strtoul(count.c_str(), nullptr, 10) : 1;
+	}
+
+	std::string head(getHeadHash());
+	CommitGraph graph;
+	std::string failed;
+	if (!graph.update(head, failed)) {
+		std::cerr << "Could not access commit " << failed << "\n";
+		exit(1);
+	}
 
-	while (hash != "0") {
-		commit.open(repositoryPath("commits/" + hash));
-		if (!commit) {
-			std::cerr << "Could not access commit " << hash << "\n";
+	std::string hash;
+	if (name == "HEAD") {
+		hash = head;
+	}
+	else {
+		std::transform(name.begin(), name.end(), name.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+		if (name.size() < 4 || name.size() > 64 || !std::all_of(name.begin(), name.end(), [](char c) { return isxdigit((unsigned char)c) != 0; })) {
+			std::cerr << "Invalid reference " << reference << "\n";
 			exit(1);
 		}
-		std::string line;
 
-		std::cout << "commit " << hash << "\n";
+		// The directory also holds sidecar indices and partially written commits, which aren't named by a bare hash.
+		std::vector<std::string> commits;
+		filesInDirectory(repositoryPath("commits"), commits);
+		std::set<std::string> present, matches;
+		for (const auto& commit : commits) {
+			if (commit.size() == 64 && std::all_of(commit.begin(), commit.end(), [](char c) { return isxdigit((unsigned char)c) != 0; })) {
+				present.insert(commit);
+				if (!commit.compare(0, name.size(), name)) {
+					matches.insert(commit);
+				}
+			}
+		}
 
-		// Discard two lines. The next line is the parent.
-		std::getline(commit, line);
-		std::getline(commit, line);
+		// Commits the graph names only count if they're still in the commits directory
+		const size_t MAX_LISTED = 10; // How many candidates to list for an ambiguous reference
+		for (const auto& match : graph.findPrefix(name, MAX_LISTED)) {
+			if (present.count(match) || std::ifstream(repositoryPath("commits/" + match))) {
+				matches.insert(match);
+			}
+		}
 
-		// Now, get the parent and extract the hash
-		std::getline(commit, line);
-		hash = line.substr(7); // There are 7 characters before the hash begins: "parent "
+		if (matches.empty()) {
+			std::cerr << "No commit matches " << reference << "\n";
+			exit(1);
+		}
+		if (matches.size() > 1) {
+			std::cerr << "Reference " << reference << " is ambiguous. It could be any of:\n";
+			size_t listed(0);
+			for (auto it = matches.begin(); it != matches.end() && listed < MAX_LISTED; ++it, ++listed) {
+				std::cerr << "  " << *it << "\n";
+			}
+			exit(1);
+		}
+		hash = *matches.begin();
+	}
 
-		// The next line is the date
-		std::getline(commit, line);
-		std::cout << "Committed on " << line.substr(5); // 5 characters: "date "
+	if (generations) {
+		if (!graph.update(hash, failed)) {
+			std::cerr << "Could not access commit " << failed << "\n";
+			exit(1);
+		}
+		size_t i(graph.find(hash));
+		for (size_t generation = 0; generation < generations && i != CommitGraph::NONE; ++generation) {
+			i = graph.parent(i);
+		}
+		if (i == CommitGraph::NONE) {
+			std::cerr << "Commit " << hash << " has fewer than " << generations << " ancestors\n";
+			exit(1);
+		}
+		hash = graph.hash(i);
+	}
 
-		// And then the time
-		std::getline(commit, line);
-		std::cout << " at " << line.substr(5) << "\n"; // Again, 5 characters: "time "
+	graph.save();
+	return hash;
+}
 
-		// The title
-		std::getline(commit, line);
-		line = escaped(line.substr(6), "/amp;", "&");
-		line = escaped(line, "/sl;", "/");
-		std::cout << "\t" << line << "\n\n"; // 6 characters: "title "
+// Warns that the file checked out at filename has hash test, rather than the hash the commit stored for it
+void warnMismatch(const std::string& filename, const std::string& hash, const std::string& test) {
+	std::cerr << "WARNING: Hash mismatch on checking out " << filename << ".\n";
+	std::cerr << "commit stored hash \"" << hash << "\"\n";
+	std::cerr << "File contents in commit have hash \"" << test << "\"\n\n";
+	std::cerr << "This means that either the commit was written improperly,\n";
+	std::cerr << "    or the commit was modified after being written.\n\n";
+	std::cerr << "While not necessarily indicative of a problem, you might want to check the file.\n";
+}
 
-		// And finally the message
-		std::getline(commit, line, '&'); // Discard the beginning
-		std::getline(commit, line, '&'); // And fetch the entire message
-		line = escaped(line, "/amp;", "&");
-		line = escaped(line, "/sl;", "/");
-		line = escaped(line, "\n", "\n\t"); // Indent every line of the commit message
-		std::cout << "\t" << line << "\n\n";
+// Returns the hash and metadata of the file at path in the working directory, or an empty hash if there is no such file
+// The hash is taken from the stat cache if the file's metadata matches what was recorded there, and read from the file otherwise.
+IndexEntry workingEntry(const IndexTable& cache, const std::string& path) {
+	IndexEntry working;
+	if (!statFile(path, working.stat)) {
+		return IndexEntry();
+	}
+	IndexEntry recorded;
+	if (cache.find(path, recorded) && recorded.matches(working.stat)) {
+		working.hash = recorded.hash;
+	}
+	else {
+		working.hash = hashOfWorkingFile(path);
+	}
+	return working;
+}
 
-		commit.close();
+// Removes the directories leading up to filename which are left empty, deepest first
+void removeEmptyParents(std::string filename) {
+	size_t slash;
+	while ((slash = filename.find_last_of("/\\")) != std::string::npos && slash) {
+		filename.erase(slash);
+		if (rmdir(filename.c_str())) {
+			return;
+		}
 	}
 }
 
+// Checks out the files of commit without asking anything, writing only those the working directory doesn't already hold
+// What each file holds is known from the stat cache if its metadata hasn't changed since it was recorded, so unchanged files aren't read at all.
+// Files which previous (the commit checked out before) tracked but commit doesn't are removed, unless they've been changed since.
+// Everything written or found up to date is recorded in the stat cache, so checking out a neighbouring commit only costs the files which differ.
+void checkoutChanges(CommitReader& commit, const MappedFile& blob, const std::string& previous, size_t jobs) {
+	const std::vector<CommitEntry>& files(commit.files());
+	IndexTable cache(repositoryPath(STATCACHE_PATH).asStdString());
+	PackSet packs;
+
+	// Find out what the working directory holds where each file goes. Files are only read if the stat cache can't tell.
+	std::vector<IndexEntry> working(files.size());
+	{
+		ThreadPool pool(jobs);
+		std::vector<std::future<IndexEntry>> found;
+		found.reserve(files.size());
+		for (const auto& entry : files) {
+			found.push_back(pool.submit([&cache, &entry]() { return workingEntry(cache, entry.path); }));
+		}
+		for (size_t i = 0; i < files.size(); ++i) {
+			working[i] = found[i].get();
+		}
+	}
+
+	// Write every file which differs beside where it belongs, each verified against its stored checksum as it goes
+	// Without a mapping, files are copied through the reader's single stream, so they can only be written one at a time.
+	// Once every file is written, they're flushed to disk and moved into place together.
+	size_t written(0);
+	uint64_t writtenSize(0);
+	{
+		ReplaceBatch batch;
+		ThreadPool pool(blob ? jobs : 1);
+		std::vector<std::future<std::pair<bool, std::string>>> unpacked(files.size());
+		for (size_t i = 0; i < files.size(); ++i) {
+			if (working[i].hash != files[i].checksum) {
+				const CommitEntry& entry(files[i]);
+				unpacked[i] = pool.submit([&commit, &blob, &packs, &entry]() {
+					std::string hash;
+					bool good(unpackFile(commit, blob, packs, entry, partialPath(entry.path), hash));
+					return std::make_pair(good, hash);
+				});
+			}
+		}
+
+		// Every file is waited for before anything is reported, so a failure can't leave a write running
+		std::string failed;
+		std::vector<bool> rewritten(files.size(), false);
+		for (size_t i = 0; i < files.size(); ++i) {
+			if (!unpacked[i].valid()) {
+				continue;
+			}
+			auto result(unpacked[i].get());
+			batch.add(partialPath(files[i].path), files[i].path);
+			if (!result.first) {
+				failed = files[i].path;
+			}
+			else if (result.second != files[i].checksum) {
+				warnMismatch(files[i].path, files[i].checksum, result.second);
+			}
+			working[i].hash = result.second;
+			rewritten[i] = true;
+			++written;
+			writtenSize += files[i].size;
+		}
+
+		if (failed.size()) {
+			batch.abandon();
+			std::cerr << "Unable to open file " << failed << " for writing.\n";
+			exit(2);
+		}
+		if (!batch.commit()) {
+			std::cerr << "Unable to move the checked out files into place.\n";
+			exit(2);
+		}
+
+		// Renaming a file can change its metadata, so the files written are only looked at once they're in place
+		for (size_t i = 0; i < files.size(); ++i) {
+			if (rewritten[i] && !statFile(files[i].path, working[i].stat)) {
+				working[i].hash.clear();
+			}
+		}
+	}
+
+	// Remove the files the previous commit tracked which this one doesn't, as long as they still hold what was committed
+	size_t removed(0);
+	CommitReader last(previous);
+	if (previous != commit.hash() && last) {
+		std::vector<std::string> paths;
+		paths.reserve(files.size());
+		for (const auto& entry : files) {
+			paths.push_back(entry.path);
+		}
+		std::sort(paths.begin(), paths.end());
+
+		for (const auto& entry : last.files()) {
+			if (std::binary_search(paths.begin(), paths.end(), entry.path)) {
+				continue;
+			}
+
+			IndexEntry current(workingEntry(cache, entry.path));
+			if (current.hash == entry.checksum) {
+				remove(entry.path.c_str());
+				removeEmptyParents(entry.path);
+				++removed;
+			}
+			else if (current.hash.size()) {
+				std::cerr << "Warning: " << entry.path << " has changed since it was checked out, so it was left in place.\n";
+			}
+			cache.erase(entry.path);
+		}
+	}
+
+	// Remember the metadata of every file, unless it changed too recently for it to be trusted
+	FileStat clock(filesystemClock());
+	for (size_t i = 0; i < files.size(); ++i) {
+		if (working[i].hash == files[i].checksum && working[i].stat.mtime < clock.mtime) {
+			cache.set(files[i].path, working[i].hash, working[i].stat);
+		}
+	}
+	cache.save(repositoryPath(STATCACHE_PATH).asStdString());
+
+	std::cout << "Checked out commit " << commit.hash() << ".\n";
+	std::cout << "Wrote " << written << " files (" << writtenSize << " bytes), removed " << removed << ", and left " << (files.size() - written) << " which were already up to date.\n";
+}
+
 // Given a commit (reference), copies files out to the working directory from the commit.
 // Reference can be one of:
-//  - A complete hash
+//  - A hash, or a unique prefix of one
 //  - HEAD (which shall be resolved to the complete hash of the current head commit)
-void checkout(std::string reference) {
+//  - Either of the above followed by ~N, for an ancestor
+// Up to jobs files are hashed and written at once.
+// If incremental is set, nothing is asked: Only files which differ are written, and files no longer tracked are removed.
+void checkout(std::string reference, size_t jobs, bool incremental) {
 	auto head = getHeadHash(); // For the lockout warning
 
-	if (reference == "HEAD") {
-		reference = head;
-		remove(repositoryPath("COMMIT_LOCK")); // Delete the lock file
+	// The commit checked out until now, whose files an incremental checkout replaces
+	std::string previous(head);
+	if (std::ifstream lock = std::ifstream(repositoryPath("COMMIT_LOCK"), std::ios::binary)) {
+		std::getline(lock, previous);
 	}
-	else if (reference != head) {
+
+	reference = reference == "HEAD" ? head : resolveReference(reference);
+
+	// The commit must be readable before the lock file can name it, or a bad reference would leave the repository locked to nothing
+	CommitReader commit(reference);
+	if (!commit) {
+		std::cerr << "Could not open commit " << reference << "\n";
+		exit(1);
+	}
+
+	// Build the file table once. Every file must lie inside the commit before we start writing any of them.
+	const std::vector<CommitEntry>& files(commit.files());
+	if (!commit) {
+		std::cerr << "Commit " << reference << " is malformed.\n";
+		exit(3);
+	}
+
+	// Map the whole commit, so file contents can be written and verified without copying them through our own buffers
+	MappedFile blob(commit.location());
+	if (blob) {
+		for (const auto& entry : files) {
+			if (entry.embedded && (entry.offset > blob.size() || entry.size > blob.size() - entry.offset)) {
+				std::cerr << "Commit " << reference << " is truncated: " << entry.path << " lies past its end.\n";
+				exit(3);
+			}
+		}
+	}
+
+	if (reference != head) {
 		// Create the lock file
-		std::ofstream lock(repositoryPath("COMMIT_LOCK"), std::ios::binary);
-		lock << reference << "\n";
+		writeFileDurably(repositoryPath("COMMIT_LOCK").asStdString(), reference + "\n");
 
 		// And issue a warning
 		std::cerr << "Warning: You are detached from the HEAD commit.\n";
@@ -707,144 +1692,337 @@ void checkout(std::string reference) {
 		remove(repositoryPath("COMMIT_LOCK")); // Delete the lock file
 	}
 
-	std::ifstream commit(repositoryPath("commits/"+reference), std::ios::binary);
-	if (!commit) {
-		std::cerr << "Could not open commit " << reference << "\n";
-		exit(1);
+	if (incremental) {
+		checkoutChanges(commit, blob, previous, jobs);
+		return;
 	}
 
-	std::string line;
+	PackSet packs; // Only read from here on, so it can be shared by every thread
+
+	// Without a mapping, files are copied through the reader's single stream, so they can only be written one at a time
+	ThreadPool pool(blob ? jobs : 1);
 
-	while (line != "&&&&&") { // Advance through commit header
-		std::getline(commit, line);
-		line = escaped(line, "\r", "");
+	// First, hash whatever is already in the working directory where each file will go
+	std::vector<std::future<std::string>> existing;
+	existing.reserve(files.size());
+	for (const auto& entry : files) {
+		existing.push_back(pool.submit([&entry]() { return hashOfWorkingFile(entry.path); }));
 	}
 
-	// Now, we can iterate over files
-	size_t numFiles(0);
-	size_t totalSize(0);
-	while (true) {
-		std::string filename;
-		std::getline(commit, filename);
-		filename = escaped(filename, "\r", "");
-		if (filename == "COMMIT FOOTER") { // The footer is not a file, so we're done.
-			break;
+	// Files which already match the commit are only checked out if the user confirms it.
+	std::vector<bool> skip(files.size(), false);
+	for (size_t i = 0; i < files.size(); ++i) {
+		if (existing[i].get() == files[i].checksum) { // Confirm with the user that they're okay with us skipping checkout based on hash
+			char result = '\0';
+			while (result != 'y' && result != 'n' && result != '\n') {
+				std::cout << "File " << files[i].path << " on disk has same SHA256 as file in commit. Checkout anyway? (y/N) ";
+				result = tolower(std::cin.get());
+				std::cin.ignore(1);
+				std::cout << std::endl;
+			}
+			skip[i] = (result != 'n');
 		}
-		else {
-			++numFiles;
+	}
+
+	// Now write out every file that isn't skipped beside where it belongs, each verified against its stored checksum as it goes
+	// Once every file is written, they're flushed to disk and moved into place together.
+	ReplaceBatch batch;
+	std::vector<std::future<std::pair<bool, std::string>>> unpacked(files.size());
+	for (size_t i = 0; i < files.size(); ++i) {
+		if (!skip[i]) {
+			const CommitEntry& entry(files[i]);
+			batch.add(partialPath(entry.path), entry.path);
+			unpacked[i] = pool.submit([&commit, &blob, &packs, &entry]() {
+				std::string hash;
+				bool written(unpackFile(commit, blob, packs, entry, partialPath(entry.path), hash));
+				return std::make_pair(written, hash);
+			});
+		}
+	}
+
+	// Report on each file, in the order the commit stores them
+	size_t numFiles(0);
+	uint64_t totalSize(0);
+	for (size_t i = 0; i < files.size(); ++i) {
+		const std::string& filename(files[i].path);
+		const std::string& hash(files[i].checksum); // The stored file checksum
+		++numFiles;
+		if (skip[i]) {
+			continue;
 		}
 		std::cout << "Unpacking file " << filename << "\n";
 
-		// Get the stored file checksum
-		std::string hash;
-		std::getline(commit, hash);
-		hash = escaped(hash, "/r", "");
-		hash = hash.substr(std::string("checksum ").size());
-
-		// Test the file in the working directory to see if it matches our checksum
-		std::ifstream file(filename, std::ios::binary);
-		bool skip(false);
-		if (file) {
-			std::string test(picosha2::hash256_hex_string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()));
-			file.close();
-			if (hash == test) { // Confirm with the user that they're okay with us skipping checkout based on hash
-				char result = '\0';
-				while (result != 'y' && result != 'n' && result != '\n') {
-					std::cout << "File on disk has same SHA256 as file in commit. Checkout anyway? (y/N) ";
-					result = tolower(std::cin.get());
-					std::cin.ignore(1);
-					std::cout << std::endl;
+		auto result(unpacked[i].get());
+		if (!result.first) {
+			// Let every other file finish, so none of them is left partly written
+			for (auto& other : unpacked) {
+				if (other.valid()) {
+					other.wait();
 				}
-				skip = (result != 'n');
-			}
-		}
-
-		// Unless skip is set, read the file in the commit out to disk
-		if (!skip) {
-			// If the filename includes a directory mark, we need to go through it and make sure the directory exists before performing checkout.
-			if (filename.find('/')!=std::string::npos || filename.find('\\') != std::string::npos) {
-				// Split the path into a list of directories
-				std::vector<std::string> parts;
-				if (filename.find("/"))
-					parts = split(filename, '/');
-				else
-					parts = split(filename, '\\');
-
-				// And then make all those directories (except the last one, which is a filename)
-				std::string path;
-				for (size_t i = 0; i < parts.size() - 1; ++i) {
-					path += parts[i] + '/';
-					mkdir(path.c_str());
+			}
+			batch.abandon();
+			std::cerr << "Unable to open file " << filename << " for writing.\n";
+			exit(2);
+		}
+		totalSize += files[i].size; // Add the size to the totalSize counter
+
+		// Now, we do the safety comparison of the hashes
+		const std::string& test(result.second);
+		if (test == hash) { // We're pretty sure checkout succeeded.
+			std::cout << "File checked out successfully.\n\n";
+		}
+		else { // We have a mismatch
+			warnMismatch(filename, hash, test);
+		}
+	}
+
+	if (!batch.commit()) {
+		std::cerr << "Unable to move the checked out files into place.\n";
+		exit(2);
+	}
+
+	// At this point, we've passed every file in the commit
+	std::cout << "Done reading files.\n";
+
+	std::cout << "commit said we were supposed to read " << commit.count() << " files.\n";
+	std::cout << "We actually read " << numFiles << " files.\n";
+
+	std::cout << "commit said we were supposed to read " << commit.size() << " bytes from files.\n";
+	std::cout << "We actually read " << totalSize << " bytes from files.\n";
+}
+
+// An object on its way into a pack, along with whatever keeps its contents in memory
+struct PackObject {
+	std::string hash;
+	std::string name; // The name (without directories) of a file holding the object, so revisions of one file can be grouped together
+	uint64_t size;
+
+	const char* data;
+	std::unique_ptr<MappedFile> mapping; // If the object is loose and unmodified
+	std::string scratch; // If the object had to be decompressed, or rebuilt from an old pack
+	uint64_t stored; // The size of the loose object, if there is one
+	uint64_t offset; // Of the object in the new pack
+	size_t depth; // The number of deltas which must be applied to read the object
+};
+
+// Points object.data at the contents of the object, mapping it if it is loose, decompressing it if it's compressed, or finding it in packs otherwise
+// Returns false if the object could not be found
+bool loadObject(const PackSet& packs, PackObject& object) {
+	object.stored = 0;
+	object.mapping.reset(new MappedFile(objectPath(object.hash).asStdString()));
+	if (*object.mapping) {
+		object.data = object.mapping->data();
+		object.stored = object.size;
+		return true;
+	}
+	object.mapping.reset();
+
+	std::ifstream compressed(objectPath(object.hash, encoding::LZ4), std::ios::in | std::ios::binary | std::ios::ate);
+	if (compressed) {
+		object.stored = compressed.tellg();
+		compressed.seekg(0);
+		std::string& scratch(object.scratch);
+		scratch.reserve((size_t)object.size);
+		if (!encoding::decode(compressed, [&scratch](const char* data, size_t size) { scratch.append(data, size); })) {
+			return false;
+		}
+		object.data = scratch.data();
+		return true;
+	}
+
+	const PackReader* pack(packs.find(object.hash));
+	uint64_t size;
+	return pack && pack->view(object.hash, object.data, size, object.scratch);
+}
+
+// Gathers the objects used by every commit reachable from HEAD, and every object already packed, into a single new pack
+// Each object is stored whole, or as a delta against one of the few objects written just before it, whichever is smaller.
+// Objects stored whole are compressed, if the repository's configuration compresses objects at all.
+// Objects are sorted by file name, then size, so that revisions of the same file sit next to each other.
+// Once every object has been read back from the new pack and verified, the loose objects and old packs it replaces are removed.
+void pack() {
+	mkdir(repositoryPath("packs")); // Repositories made before packs existed won't have the directory yet
+
+	std::string head(getHeadHash());
+	if (head == "") {
+		std::cerr << "Could not find repository head - have you run init?\n";
+		exit(1);
+	}
+
+	int level((int)Config().getNumber("compression", 0));
+	std::vector<std::unique_ptr<PackObject>> objects;
+	std::vector<std::string> oldPacks;
+	std::string name; // Of the new pack
+	size_t deltas(0);
+	uint64_t looseSize(0);
+	{
+		PackSet packs;
+
+		// Walk the history the same way log does, naming each object after a file which holds it
+		std::map<std::string, std::string> names;
+		std::string hash(head);
+		while (hash != "0") {
+			CommitReader commit(hash);
+			if (!commit) {
+				std::cerr << "Could not access commit " << hash << "\n";
+				exit(1);
+			}
+
+			const std::vector<CommitEntry>& files(commit.files());
+			if (!commit) {
+				std::cerr << "Commit " << hash << " is malformed.\n";
+				exit(1);
+			}
+			for (const auto& entry : files) {
+				if (!entry.embedded) {
+					size_t slash(entry.path.find_last_of("/\\"));
+					names.emplace(entry.checksum, slash == std::string::npos ? entry.path : entry.path.substr(slash + 1));
 				}
 			}
+			hash = commit.parent();
+		}
 
-			std::fstream file(filename, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
-			if (!file) {
-				std::cerr << "Unable to open file " << filename << " for writing.\n";
-				exit(2);
+		// Objects which were packed before are kept, whether or not anything reachable still uses them
+		for (const auto& reader : packs.packs()) {
+			oldPacks.push_back(reader->name());
+			for (size_t i = 0; i < reader->count(); ++i) {
+				names.emplace(reader->hashAt(i), "");
+			}
+		}
+
+		for (const auto& it : names) {
+			std::unique_ptr<PackObject> object(new PackObject);
+			object->hash = it.first;
+			object->name = it.second;
+			if (!packs.objectSize(object->hash, object->size)) {
+				std::cerr << "Object " << object->hash << " is missing from the object store.\n";
+				exit(1);
+			}
+			objects.push_back(std::move(object));
+		}
+		std::sort(objects.begin(), objects.end(), [](const std::unique_ptr<PackObject>& a, const std::unique_ptr<PackObject>& b) {
+			if (a->name != b->name) {
+				return a->name < b->name;
 			}
+			return a->size > b->size; // Larger revisions first, as deleting data makes for smaller deltas than inserting it
+		});
 
-			std::getline(commit, line, ' '); // Line now holds the size field's identifier
-			size_t filesize;
-			commit >> filesize; // And now we let istream perform the input conversion
-			totalSize += filesize; // Add the size to the totalSize counter
-			
-			// Now, get rid of the extraneous characters
-			std::getline(commit, line, '&');
-			std::getline(commit, line);
+		PackWriter writer;
+		if (!writer) {
+			std::cerr << "Could not create pack.\n";
+			exit(1);
+		}
+		writer.begin(objects.size());
+
+		std::deque<PackObject*> window; // The objects most recently written, which may serve as delta bases
+		std::string best, attempt, block;
+		for (const auto& object : objects) {
+			if (!loadObject(packs, *object)) {
+				std::cerr << "Could not read object " << object->hash << ".\n";
+				exit(1);
+			}
+			looseSize += object->stored;
+
+			// A delta is only worth its decoding cost if it at least halves the object
+			const PackObject* base(nullptr);
+			if (object->size <= packfile::MAX_DELTA_SIZE) {
+				for (const auto& candidate : window) {
+					if (candidate->depth >= packfile::MAX_CHAIN) {
+						continue;
+					}
+					size_t limit(base ? best.size() - 1 : (size_t)object->size / 2);
+					if (delta::encode(candidate->data, (size_t)candidate->size, object->data, (size_t)object->size, limit, attempt)) {
+						best.swap(attempt);
+						base = candidate;
+					}
+				}
+			}
 
-			// The get pointer is now at the beginning of the file
-			// Allocate a buffer and read the prescribed size out of the file
-			char* contents(new char[filesize]);
-			commit.read(contents, filesize);
+			if (base) {
+				object->offset = writer.addDelta(object->hash, best, object->size, base->offset);
+				object->depth = base->depth + 1;
+				++deltas;
+			}
+			else {
+				// Compressing objects as one block means holding all of them in memory, so very large ones are left alone
+				bool compressed(false);
+				if (level > 0 && object->size <= packfile::MAX_DELTA_SIZE && encoding::worthCompressing(object->data, object->size)) {
+					lz4::compress(object->data, (size_t)object->size, block, level);
+					compressed = (block.size() < object->size);
+				}
 
-			// And write the buffer back onto the disk
-			file.write(contents, filesize);
+				if (compressed) {
+					object->offset = writer.addCompressed(object->hash, block, object->size);
+				}
+				else {
+					object->offset = writer.addWhole(object->hash, object->data, object->size);
+				}
+				object->depth = 0;
+			}
 
-			// Now, we do the safety comparison of the hashes
-			file.seekg(0, std::ios::beg);
-			std::string test(picosha2::hash256_hex_string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()));
-			file.close();
-			if (test == hash) { // We're pretty sure checkout succeeded.
-				std::cout << "File checked out successfully.\n\n";
+			if (object->size <= packfile::MAX_DELTA_SIZE) {
+				window.push_back(object.get());
+				if (window.size() > packfile::WINDOW) {
+					window.front()->mapping.reset();
+					window.front()->scratch.clear();
+					window.pop_front();
+				}
 			}
-			else { // We have a mismatch
-				std::cerr << "WARNING: Hash mismatch on checking out " << filename << ".\n";
-				std::cerr << "commit stored hash \"" << hash << "\"\n";
-				std::cerr << "File written to disk has hash \"" << test << "\"\n\n";
-				std::cerr << "This means that either the commit was written improperly,\n";
-				std::cerr << "    the commit was modified after being written,\n";
-				std::cerr << "    or the file was not checked out correctly.\n\n";
-				std::cerr << "While not necessarily indicative of a problem, you might want to check the file.\n";
+			else {
+				object->mapping.reset();
+				object->scratch.clear();
 			}
+		}
+		for (const auto& object : objects) { // Every mapping must be closed before the files behind them are removed
+			object->mapping.reset();
+			object->scratch.clear();
+		}
 
-			// Read out the rest of the line to pass the file footer
-			std::getline(commit, line, '&');
-			std::getline(commit, line);
+		name = writer.finish();
+		if (name == "") {
+			std::cerr << "Could not write pack.\n";
+			exit(1);
 		}
-		else { // Forward until we pass the file footer
-			std::getline(commit, line, ' '); // Line now holds the size field's identifier
-			size_t filesize;
-			commit >> filesize; // And now we let istream perform the input conversion
-			std::getline(commit, line, '&');
-			std::getline(commit, line);
-			commit.seekg((size_t)commit.tellg() + filesize + 6); // 6 characters are past the EOF: five ampersands and a newline
+	}
+
+	// Make sure every object can be read back from the new pack before removing anything it replaces
+	uint64_t packedSize(0);
+	{
+		PackReader written(name);
+		bool good = static_cast<bool>(written);
+		for (const auto& object : objects) {
+			const char* data;
+			uint64_t size;
+			std::string scratch;
+			if (!good || !written.view(object->hash, data, size, scratch) || hashOfBuffer(data, size) != object->hash) {
+				good = false;
+				break;
+			}
+		}
+
+		std::ifstream packed(repositoryPath("packs/" + name + ".pack"), std::ios::binary | std::ios::ate);
+		packedSize = packed.tellg();
+
+		if (!good) {
+			remove(repositoryPath("packs/" + name + ".idx"));
+			remove(repositoryPath("packs/" + name + ".pack"));
+			std::cerr << "Could not verify the objects written to the new pack.\n";
+			std::cerr << "The repository has not been changed.\n";
+			exit(1);
 		}
 	}
 
-	// At this point, we've arrived at and read the line "COMMIT FOOTER"
-	std::cout << "Done reading files.\n";
+	for (const auto& object : objects) {
+		remove(objectPath(object->hash));
+		remove(objectPath(object->hash, encoding::LZ4));
+	}
+	for (const auto& old : oldPacks) {
+		if (old != name) { // An unchanged repository packs to the same name
+			remove(repositoryPath("packs/" + old + ".idx"));
+			remove(repositoryPath("packs/" + old + ".pack"));
+		}
+	}
 
-	std::getline(commit, line); // Discard the three ampersands that delineate the commit footer's header
-	std::getline(commit, line, ' '); // Discard up until the counter
-	size_t files;
-	commit >> files;
-	std::cout << "commit said we were supposed to read " << files << " files.\n";
-	std::cout << "We actually read " << numFiles << " files.\n";
-	
-	std::getline(commit, line, ' '); // Discard up until the next counter
-	size_t size;
-	commit >> size;
-	std::cout << "commit said we were supposed to read " << size << " bytes from files.\n";
-	std::cout << "We actually read " << totalSize << " bytes from files.\n";
+	std::cout << "Packed " << objects.size() << " objects into " << name << ", " << deltas << " of them as deltas.\n";
+	std::cout << "Loose objects took " << looseSize << " bytes. The pack takes " << packedSize << " bytes.\n";
 }
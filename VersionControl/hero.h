@@ -6,18 +6,61 @@
 #pragma once
 
 #include "Utils.h"
+#include "crossplatform.h"
+#include "shani.h"
 #include "../PicoSHA2/picosha2.h"
 #include <string>
+#include <vector>
+#include <memory>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 
 const std::string REPOSITORY_PATH(".hero");
 const std::string INDEXMAP_PATH("index/map");
+const std::string STATCACHE_PATH("statcache"); // The hashes and metadata of committed files, kept in the same format as the index map
+const std::string COMMITGRAPH_PATH("commit-graph");
+const std::string IGNOREFILE_PATH(".heroignore"); // In the working directory, rather than the repository
 
 // Returns a convertible path to the file which could be accessed by filename from a program whose working directory is REPOSITORY_PATH
 CStr repositoryPath(const std::string& filename) {
 	return appended(REPOSITORY_PATH, "/"+filename);
 }
 
+// Returns a convertible path to the object holding the file contents with the given hash
+// Objects stored with an encoding (like compressed objects) have it as an extension.
+CStr objectPath(const std::string& hash, const std::string& encoding = "") {
+	return repositoryPath("objects/" + hash + (encoding.size() ? "." + encoding : ""));
+}
+
+// Converts a SHA256 as hex into its 32 raw bytes
+// Returns false if hex is not a complete SHA256
+bool digestFromHex(const std::string& hex, char* out) {
+	if (hex.size() != 64) {
+		return false;
+	}
+	for (size_t i = 0; i < 32; ++i) {
+		int high(hexValue(hex[2 * i])), low(hexValue(hex[2 * i + 1]));
+		if (high < 0 || low < 0) {
+			return false;
+		}
+		out[i] = (char)((high << 4) | low);
+	}
+	return true;
+}
+
+// Converts 32 raw bytes of SHA256 into hex
+std::string hexFromDigest(const char* raw) {
+	static const char digits[] = "0123456789abcdef";
+	std::string out(64, '0');
+	for (size_t i = 0; i < 32; ++i) {
+		out[2 * i] = digits[((unsigned char)raw[i]) >> 4];
+		out[2 * i + 1] = digits[((unsigned char)raw[i]) & 0xf];
+	}
+	return out;
+}
+
 std::string getHeadHash() {
 	std::ifstream HEAD(repositoryPath("HEAD"));
 	if (!HEAD)
@@ -28,9 +71,153 @@ std::string getHeadHash() {
 	return out;
 }
 
+// The interface every SHA256 implementation provides to Hasher
+// Implementations consume contiguous buffers of any size, and produce the 32-byte digest once all data is consumed
+class HashBackend {
+public:
+	virtual ~HashBackend() {}
+
+	virtual void update(const unsigned char* data, size_t size) = 0;
+	virtual void finish(unsigned char digest[32]) = 0;
+};
+
+// The portable implementation, which works everywhere
+class PicoSHA2Backend : public HashBackend {
+public:
+	void update(const unsigned char* data, size_t size) override {
+		m_hasher.process(data, data + size);
+	}
+
+	void finish(unsigned char digest[32]) override {
+		m_hasher.finish();
+		m_hasher.get_hash_bytes(digest, digest + 32);
+	}
+protected:
+	picosha2::hash256_one_by_one m_hasher;
+};
+
+#if defined(SHANI_AVAILABLE)
+// The implementation using the x86 SHA extensions. Only usable if shaniSupported().
+// Whole blocks are compressed straight from the caller's buffer: Only partial blocks are buffered here.
+class ShaniBackend : public HashBackend {
+public:
+	ShaniBackend() : m_state{ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 }, m_buffered(0), m_length(0) {}
+
+	void update(const unsigned char* data, size_t size) override {
+		m_length += size;
+
+		// First, finish off any partial block left from before
+		if (m_buffered) {
+			size_t fill(64 - m_buffered);
+			if (size < fill) {
+				memcpy(m_buffer + m_buffered, data, size);
+				m_buffered += size;
+				return;
+			}
+			memcpy(m_buffer + m_buffered, data, fill);
+			shaniCompress(m_state, m_buffer, 1);
+			data += fill;
+			size -= fill;
+			m_buffered = 0;
+		}
+
+		// Then every whole block in place, and keep whatever is left over
+		shaniCompress(m_state, data, size / 64);
+		data += size - size % 64;
+		m_buffered = size % 64;
+		memcpy(m_buffer, data, m_buffered);
+	}
+
+	void finish(unsigned char digest[32]) override {
+		// Pad with a single 1 bit, then zeroes up to the last eight bytes of a block, which hold the length in bits
+		uint64_t bits(m_length * 8);
+		unsigned char padding[72] = { 0x80 };
+		size_t count(m_buffered < 56 ? 56 - m_buffered : 120 - m_buffered);
+		for (int i = 0; i < 8; ++i) {
+			padding[count + i] = (unsigned char)(bits >> (56 - 8 * i));
+		}
+		update(padding, count + 8);
+
+		for (int i = 0; i < 8; ++i) {
+			digest[4 * i] = (unsigned char)(m_state[i] >> 24);
+			digest[4 * i + 1] = (unsigned char)(m_state[i] >> 16);
+			digest[4 * i + 2] = (unsigned char)(m_state[i] >> 8);
+			digest[4 * i + 3] = (unsigned char)m_state[i];
+		}
+	}
+protected:
+	uint32_t m_state[8];
+	unsigned char m_buffer[64];
+	size_t m_buffered;
+	uint64_t m_length;
+};
+#endif
+
+// Computes a SHA256 hash incrementally, using the fastest backend the CPU supports
+// The backend is chosen once per run. Setting the environment variable HERO_SHA256 to "picosha2" forces the portable one.
+class Hasher {
+public:
+	Hasher() : m_backend(makeBackend()) {}
+
+	// Returns the name of the backend in use
+	static const char* backendName() {
+		static const char* name(chooseBackend());
+		return name;
+	}
+
+	Hasher& update(const char* data, size_t size) {
+		m_backend->update((const unsigned char*)data, size);
+		return *this;
+	}
+
+	// Completes the hash, and returns it as a hex string
+	// The Hasher cannot be updated any further afterwards.
+	std::string hexDigest() {
+		unsigned char digest[32];
+		m_backend->finish(digest);
+		return picosha2::bytes_to_hex_string(digest, digest + 32);
+	}
+protected:
+	static const char* chooseBackend() {
+		const char* forced(getenv("HERO_SHA256"));
+		if (forced && std::string(forced) == "picosha2") {
+			return "picosha2";
+		}
+		return shaniSupported() ? "shani" : "picosha2";
+	}
+
+	static std::unique_ptr<HashBackend> makeBackend() {
+#if defined(SHANI_AVAILABLE)
+		if (backendName()[0] == 's') {
+			return std::unique_ptr<HashBackend>(new ShaniBackend);
+		}
+#endif
+		return std::unique_ptr<HashBackend>(new PicoSHA2Backend);
+	}
+protected:
+	std::unique_ptr<HashBackend> m_backend;
+};
+
+// Returns the SHA256 hash of size bytes at data
+std::string hashOfBuffer(const char* data, size_t size) {
+	return Hasher().update(data, size).hexDigest();
+}
+
 // Returns the SHA256 hash of the stream
 std::string hashOfFile(std::istream& ifs) {
-	return picosha2::hash256_hex_string(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+	Hasher hasher;
+	std::vector<char> buffer(1 << 16);
+	while (ifs) {
+		ifs.read(buffer.data(), buffer.size());
+		if (ifs.gcount() <= 0) {
+			break;
+		}
+		hasher.update(buffer.data(), (size_t)ifs.gcount());
+	}
+	if (ifs.eof()) {
+		ifs.clear(std::ios::eofbit); // Reaching the end isn't a failure: Leave the stream seekable, as an iterator pass would have
+	}
+	return hasher.hexDigest();
 }
 
 // Returns the SHA256 hash of the file at filename
@@ -39,6 +226,70 @@ std::string hashOfFile(const std::string& filename) {
 	return hashOfFile(ifs);
 }
 
+// Copies the file at source to dest, hashing the contents as they are copied, so the source is only read once
+// On copy-on-write filesystems, the copy is a reflink instead, so nothing is copied, and the hash is read from the copy.
+// Either way, the hash describes exactly what's in dest, even if source changes meanwhile.
+// Returns the SHA256 of the copied contents, or an empty string if the copy failed
+std::string hashedCopy(const std::string& source, const std::string& dest) {
+	if (reflinkFile(source.c_str(), dest.c_str())) {
+		std::ifstream copy(dest, std::ios::binary);
+		if (!copy) {
+			return "";
+		}
+		std::string hash(hashOfFile(copy));
+		return copy.bad() ? "" : hash;
+	}
+
+	std::ifstream in(source, std::ios::binary);
+	if (!in) {
+		return "";
+	}
+	std::ofstream out(dest, std::ios::binary | std::ios::trunc);
+	if (!out) {
+		return "";
+	}
+
+	Hasher hasher;
+	std::vector<char> buffer(1 << 16);
+	while (in) {
+		in.read(buffer.data(), buffer.size());
+		std::streamsize count(in.gcount());
+		if (count <= 0) {
+			break;
+		}
+		hasher.update(buffer.data(), (size_t)count);
+		out.write(buffer.data(), count);
+	}
+	if (in.bad()) {
+		return "";
+	}
+	out.close();
+	if (!out) {
+		return "";
+	}
+
+	return hasher.hexDigest();
+}
+
+// Makes dest a hard link to the file at source, then hashes it, so nothing is copied at all
+// dest shares its contents with source until it's committed, so changes made to source in place meanwhile show up in dest too.
+//   Commit hashes it again, then copies the contents out and checks the copy against that hash before storing or compressing it.
+// The link is hashed by reading it rather than mapping it, since the file can be truncated while it's read.
+// Returns the SHA256 of the linked contents, or an empty string if the link could not be made
+std::string hashedLink(const std::string& source, const std::string& dest) {
+	if (!linkFile(source, dest)) {
+		return "";
+	}
+
+	std::ifstream link(dest, std::ios::binary);
+	std::string hash(link ? hashOfFile(link) : "");
+	if (hash == "" || link.bad()) {
+		remove(dest.c_str());
+		return "";
+	}
+	return hash;
+}
+
 // Specialize the hasher for an ifstream reference
 namespace picosha2 {
 	std::string hash256_hex_string(std::ifstream& ifs) {
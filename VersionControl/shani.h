@@ -0,0 +1,137 @@
+// shani.h: SHA256 block compression using the x86 SHA extensions (SHA-NI), and detection of them at runtime
+// SHANI_AVAILABLE is defined if this compiler and architecture can build the accelerated code at all.
+// Whether the CPU we're running on supports it must still be checked with shaniSupported().
+
+#ifndef SHANI_H
+#define SHANI_H
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SHANI_AVAILABLE
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SHANI_TARGET
+#else
+#include <cpuid.h>
+// GCC and Clang only allow the intrinsics in functions compiled for a CPU which has them
+#define SHANI_TARGET __attribute__((target("sha,sse4.1")))
+#endif
+#endif
+
+#if defined(SHANI_AVAILABLE)
+// Returns whether the CPU supports the SHA extensions, plus the SSSE3 and SSE4.1 instructions used alongside them
+bool shaniSupported() {
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return false;
+	}
+	__cpuidex(info, 7, 0);
+	bool sha((info[1] & (1 << 29)) != 0);
+	__cpuid(info, 1);
+	bool ssse3((info[2] & (1 << 9)) != 0);
+	bool sse41((info[2] & (1 << 19)) != 0);
+#else
+	unsigned int a, b, c, d;
+	if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+		return false;
+	}
+	bool sha((b & (1u << 29)) != 0);
+	if (!__get_cpuid(1, &a, &b, &c, &d)) {
+		return false;
+	}
+	bool ssse3((c & (1u << 9)) != 0);
+	bool sse41((c & (1u << 19)) != 0);
+#endif
+	return sha && ssse3 && sse41;
+}
+
+// Four rounds, using the four message words in w and the round constants for group g
+#define SHANI_ROUNDS(w, g) \
+	msg = _mm_add_epi32(w, _mm_loadu_si128((const __m128i*)&k[4 * (g)])); \
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+	msg = _mm_shuffle_epi32(msg, 0x0E); \
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg)
+// The two halves of the message schedule
+#define SHANI_SCHEDULE1(prev, cur) prev = _mm_sha256msg1_epu32(prev, cur)
+#define SHANI_SCHEDULE2(next, cur, prev) next = _mm_sha256msg2_epu32(_mm_add_epi32(next, _mm_alignr_epi8(cur, prev, 4)), cur)
+
+// Runs the SHA256 compression function over count consecutive 64-byte blocks, updating state
+// Adapted from the public domain reference code published alongside Intel's description of the SHA extensions
+SHANI_TARGET void shaniCompress(uint32_t state[8], const unsigned char* blocks, size_t count) {
+	static const uint32_t k[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+	};
+	const __m128i mask(_mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL)); // Converts big-endian words
+
+	// The instructions want the state as ABEF and CDGH, rather than ABCD and EFGH
+	__m128i tmp(_mm_loadu_si128((const __m128i*)&state[0]));
+	__m128i state1(_mm_loadu_si128((const __m128i*)&state[4]));
+	tmp = _mm_shuffle_epi32(tmp, 0xB1); // CDAB
+	state1 = _mm_shuffle_epi32(state1, 0x1B); // EFGH
+	__m128i state0(_mm_alignr_epi8(tmp, state1, 8)); // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+
+	__m128i msg, w0, w1, w2, w3;
+	for (; count; --count, blocks += 64) {
+		__m128i abef(state0);
+		__m128i cdgh(state1);
+
+		w0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(blocks + 0)), mask);
+		SHANI_ROUNDS(w0, 0);
+		w1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(blocks + 16)), mask);
+		SHANI_ROUNDS(w1, 1); SHANI_SCHEDULE1(w0, w1);
+		w2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(blocks + 32)), mask);
+		SHANI_ROUNDS(w2, 2); SHANI_SCHEDULE1(w1, w2);
+		w3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(blocks + 48)), mask);
+		SHANI_ROUNDS(w3, 3); SHANI_SCHEDULE2(w0, w3, w2); SHANI_SCHEDULE1(w2, w3);
+
+		SHANI_ROUNDS(w0, 4); SHANI_SCHEDULE2(w1, w0, w3); SHANI_SCHEDULE1(w3, w0);
+		SHANI_ROUNDS(w1, 5); SHANI_SCHEDULE2(w2, w1, w0); SHANI_SCHEDULE1(w0, w1);
+		SHANI_ROUNDS(w2, 6); SHANI_SCHEDULE2(w3, w2, w1); SHANI_SCHEDULE1(w1, w2);
+		SHANI_ROUNDS(w3, 7); SHANI_SCHEDULE2(w0, w3, w2); SHANI_SCHEDULE1(w2, w3);
+
+		SHANI_ROUNDS(w0, 8); SHANI_SCHEDULE2(w1, w0, w3); SHANI_SCHEDULE1(w3, w0);
+		SHANI_ROUNDS(w1, 9); SHANI_SCHEDULE2(w2, w1, w0); SHANI_SCHEDULE1(w0, w1);
+		SHANI_ROUNDS(w2, 10); SHANI_SCHEDULE2(w3, w2, w1); SHANI_SCHEDULE1(w1, w2);
+		SHANI_ROUNDS(w3, 11); SHANI_SCHEDULE2(w0, w3, w2); SHANI_SCHEDULE1(w2, w3);
+
+		SHANI_ROUNDS(w0, 12); SHANI_SCHEDULE2(w1, w0, w3); SHANI_SCHEDULE1(w3, w0);
+		SHANI_ROUNDS(w1, 13); SHANI_SCHEDULE2(w2, w1, w0);
+		SHANI_ROUNDS(w2, 14); SHANI_SCHEDULE2(w3, w2, w1);
+		SHANI_ROUNDS(w3, 15);
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	// And back to ABCD and EFGH
+	tmp = _mm_shuffle_epi32(state0, 0x1B); // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1); // DCHG
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+	state1 = _mm_alignr_epi8(state1, tmp, 8); // HGFE
+	_mm_storeu_si128((__m128i*)&state[0], state0);
+	_mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+#undef SHANI_ROUNDS
+#undef SHANI_SCHEDULE1
+#undef SHANI_SCHEDULE2
+#else
+bool shaniSupported() {
+	return false;
+}
+#endif
+#endif // !SHANI_H
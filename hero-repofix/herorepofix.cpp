@@ -3,10 +3,15 @@
 
 #include "crossplatform.h"
 #include "classes\indexmap.h"
+#include "classes\commitreader.h"
+#include "classes\commitwriter.h"
 #include <string>
+#include <vector>
+#include <map>
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
+#include <cctype>
 
 void usage(const char* invoke) {
 	std::cout << "Usage: " << invoke << " source-version|-h|--heuristic\n";
@@ -19,7 +24,8 @@ void usage(const char* invoke) {
 	std::cout << "      only a few versions are valid here. These are:\n";
 	std::cout << "        \"0.02.1\"\n";
 	std::cout << "        \"0.02.2\"\n";
-	std::cout << "        \"0.03.0 (current)\"\n";
+	std::cout << "        \"0.03.0\"\n";
+	std::cout << "        \"0.04.0 (current)\"\n";
 	std::cout << "  --heuristic\tAttempts to guess which source-version is appropriate\n";
 	std::cout << "    Any known conditions where this is guaranteed to fail shall be listed here.\n";
 	std::cout << "    This is never, however, guaranteed to succeed. If you know a past version where\n";
@@ -28,10 +34,207 @@ void usage(const char* invoke) {
 	exit(1);
 }
 
+// Returns whether name could be the hash of a commit (rather than a sidecar index, or a partially written commit)
+bool isCommitHash(const std::string& name) {
+	if (name.size() != 64) {
+		return false;
+	}
+	for (char c : name) {
+		if (!isxdigit(c)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Rewrites the commit with the given hash so that its files are stored in the object store, with parent as its parent
+// Files whose contents no longer match their checksum are left embedded, so they can't be mistaken for good objects.
+// Returns the hash of the rewritten commit, or an empty string if it could not be written
+std::string migrateCommit(const std::string& hash, const std::string& parent) {
+	CommitReader reader(hash);
+	if (!reader) {
+		return "";
+	}
+	MappedFile blob(reader.location());
+	if (!blob) {
+		return "";
+	}
+
+	CommitWriter writer;
+	if (!writer) {
+		return "";
+	}
+
+	// Copy the header as it is, except for the parent
+	std::ifstream header(reader.location(), std::ios::in | std::ios::binary);
+	std::string line;
+	bool replaced(false);
+	do {
+		std::getline(header, line);
+		if (!replaced && !line.find("parent ")) {
+			bool carriageReturn(line.size() && line.back() == '\r');
+			line = "parent " + parent + (carriageReturn ? "\r" : "");
+			replaced = true;
+		}
+		writer << line << "\n";
+	} while (header && line != "&&&&&" && line != "&&&&&\r");
+	if (!header) {
+		return "";
+	}
+
+	const std::vector<CommitEntry>& files(reader.files());
+	reader.count(); // Reads the footer, which must be well formed too
+	if (!reader) {
+		std::cerr << "Commit " << hash << " is malformed.\n";
+		return "";
+	}
+
+	for (const auto& entry : files) {
+		writer << entry.path << "\n";
+		writer << "checksum " << entry.checksum << "\n";
+		writer << "size " << entry.size << "\n";
+
+		if (!entry.embedded) {
+			if (entry.encoding.size()) {
+				writer << "encoding " << entry.encoding << "\n";
+			}
+			writer << "&&&&&\n";
+			writer.addObject(entry.path, entry.checksum, entry.size, entry.encoding);
+			continue;
+		}
+
+		if (entry.offset > blob.size() || entry.size > blob.size() - entry.offset) {
+			std::cerr << "Commit " << hash << " is truncated.\n";
+			return "";
+		}
+
+		const char* contents(blob.data() + entry.offset);
+		if (hashOfBuffer(contents, entry.size) == entry.checksum) {
+			// Write the object under a temporary name, so a partial object can never be taken for a good one
+			std::string object(objectPath(entry.checksum));
+			if (!std::ifstream(object)) {
+				std::string partial(object + ".partial");
+				if (!blob.writeRange(entry.offset, entry.size, partial.c_str()) || rename(partial.c_str(), object.c_str())) {
+					remove(partial.c_str());
+					return "";
+				}
+			}
+
+			writer << "&&&&&\n";
+			writer.addObject(entry.path, entry.checksum, entry.size);
+		}
+		else {
+			std::cerr << "Warning: " << entry.path << " in commit " << hash << " does not match its checksum.\n";
+			std::cerr << "It will stay embedded in the commit.\n";
+
+			writer << "&&&\n";
+			writer.addEntry(entry.path, entry.checksum, entry.size);
+			writer.write(contents, entry.size);
+			writer << "&&&&&\n";
+		}
+	}
+
+	writer.markFooter();
+	writer << "COMMIT FOOTER\n";
+	writer << "&&&\n";
+	writer << "count " << reader.count() << "\n";
+	writer << "size " << reader.size() << "\n";
+	writer << "&&&&&\n";
+
+	return writer.finish();
+}
+
+// Replaces the hash stored in the marker file at location (like HEAD) using the map of rewritten commits
+// The marker is replaced in one step, so a crash can't leave it empty.
+void rewriteMarker(const std::string& location, const std::map<std::string, std::string>& rewritten) {
+	std::ifstream marker(location, std::ios::in | std::ios::binary);
+	if (!marker) {
+		return;
+	}
+	std::string hash;
+	std::getline(marker, hash);
+	marker.close();
+	if (hash.size() && hash.back() == '\r') {
+		hash.pop_back();
+	}
+
+	auto it(rewritten.find(hash));
+	if (it != rewritten.end() && !writeFileDurably(location, it->second + "\n")) {
+		std::cerr << "Could not update " << location << " to " << it->second << ".\n";
+		exit(1);
+	}
+}
+
 void upgradeFrom(const std::string& source) {
-	if (source == "0.03.0") {
+	if (source == "0.04.0") {
 		// Upgrade this version to itself. Do nothing
-		exit(0);
+		return;
+	}
+	else if (source == "0.03.0") {
+		// 0.04.0 stores file contents once, in the object store, rather than in every commit which includes them.
+		// Old commits are still readable, but every commit must be rewritten to actually share the contents.
+		// Rewriting a commit changes its hash, so its children must be rewritten after it, with the new hash as their parent.
+		mkdir(".hero/objects");
+
+		std::vector<std::string> names;
+		if (filesInDirectory(".hero/commits", names)) {
+			std::cerr << "Could not upgrade repository past 0.03.0.\n";
+			exit(1);
+		}
+
+		std::map<std::string, std::string> rewritten; // Maps old commit hashes to new ones
+		rewritten["0"] = "0";
+		for (const auto& name : names) {
+			if (!isCommitHash(name)) {
+				continue;
+			}
+
+			// Walk back to the nearest commit which has already been rewritten...
+			std::vector<std::pair<std::string, std::string>> chain; // Each commit waiting to be rewritten, with its old parent
+			std::string current(name);
+			while (!rewritten.count(current)) {
+				CommitReader reader(current);
+				if (!reader) {
+					std::cerr << "Could not read commit " << current << ".\n";
+					std::cerr << "Could not upgrade repository past 0.03.0.\n";
+					exit(1);
+				}
+				chain.emplace_back(current, reader.parent());
+				current = reader.parent();
+			}
+
+			// ...then rewrite forwards from there
+			for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+				std::string hash(migrateCommit(it->first, rewritten[it->second]));
+				if (hash == "") {
+					std::cerr << "Could not rewrite commit " << it->first << ".\n";
+					std::cerr << "Could not upgrade repository past 0.03.0.\n";
+					exit(1);
+				}
+				rewritten[it->first] = hash;
+			}
+		}
+
+		// Only now that every commit has been rewritten is it safe to remove the old ones
+		bool changed(false);
+		for (const auto& it : rewritten) {
+			if (it.first != it.second) {
+				std::cout << "Rewrote commit " << it.first << " as " << it.second << "\n";
+				remove((".hero/commits/" + it.first).c_str());
+				remove((".hero/commits/" + it.first + ".idx").c_str());
+				changed = true;
+			}
+		}
+
+		// The commit graph still names the old commits. hero rebuilds it from the new ones when it's missing.
+		if (changed) {
+			remove((".hero/" + COMMITGRAPH_PATH).c_str());
+		}
+		rewriteMarker(".hero/HEAD", rewritten);
+		rewriteMarker(".hero/COMMIT_LOCK", rewritten);
+
+		// And upgrade from the next version
+		upgradeFrom("0.04.0");
 	}
 	else if (source == "0.02.2") {
 		// There isn't a different in the commit format or directory structures.
@@ -100,6 +303,7 @@ int main(int argc, char* argv[]) {
 				upgradeFrom("0.02.2");
 			else {
 				// If there are no index files we don't care about 0.03.0. If there are, and there is an indexmap, we are post-0.03.0
+				// Rewriting commits is harmless for ones which are already in the current format, so always upgrade from 0.03.0.
 				upgradeFrom("0.03.0");
 			}
 		}
@@ -10,23 +10,7 @@ echo -e "\021\00A\018\00A" | ../x64/Debug/hero.exe commit checkoutTest.txt
 git checkout add-checkout checkoutTest.txt
 echo -e "\022\00A\018\00A" | ../x64/Debug/hero.exe commit checkoutTest.txt
 
-i=0
-hash=""
-while read -r line
-do
-    if [[ "$line" == "commit "* ]]; then
-        if [ $i == 1 ]; then
-            hash=$(echo $line | sed -ne 's/^commit //p')
-            i=$((i+1))
-        else
-            i=$((i+1))
-        fi
-    fi
-done <<EOT
-$(../x64/Debug/hero.exe log)
-EOT
-
-eval ../x64/Debug/hero.exe checkout $(echo $hash)
+../x64/Debug/hero.exe checkout HEAD~1
 cat checkoutTest.txt
 sleep 10
 ../x64/Debug/hero.exe checkout HEAD
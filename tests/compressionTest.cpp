@@ -0,0 +1,148 @@
+// compressionTest.cpp: Tests the LZ4 block codec and the framing of compressed objects in compression.h
+// The reference blocks below were written by the reference LZ4 library (1.9.4, LZ4_compress_default), so they check that we read what it writes.
+// Build and run with compressionTest.sh. With REFERENCE_LZ4 defined, and the reference library linked in,
+//   blocks we write are also checked by the reference decoder, and blocks it writes for larger inputs by ours.
+
+#include "../VersionControl/compression.h"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#if defined(REFERENCE_LZ4)
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+int failures(0);
+
+void check(bool passed, const std::string& test) {
+	if (!passed) {
+		std::cerr << "FAILED: " << test << "\n";
+		++failures;
+	}
+}
+
+// Returns size bytes which don't compress, the same ones every time for the same seed
+std::string noise(size_t size, uint32_t seed) {
+	std::string out;
+	for (size_t i = 0; i < size; ++i) {
+		seed = seed * 1103515245u + 12345u;
+		out += (char)(seed >> 16);
+	}
+	return out;
+}
+
+std::string repeated(const std::string& text, size_t count) {
+	std::string out;
+	for (size_t i = 0; i < count; ++i) {
+		out += text;
+	}
+	return out;
+}
+
+// Returns whether block decompresses to exactly contents
+bool decompresses(const std::string& block, const std::string& contents) {
+	std::vector<char> out(contents.size() + 1);
+	return lz4::decompress(block.data(), block.size(), out.data(), contents.size()) && !contents.compare(0, contents.size(), out.data(), contents.size());
+}
+
+// Compresses contents at every level, and checks each block is within the bound and decompresses back to contents
+void roundTrip(const std::string& name, const std::string& contents) {
+	for (int level = 1; level <= lz4::MAX_LEVEL; ++level) {
+		std::string block;
+		lz4::compress(contents.data(), contents.size(), block, level);
+		std::string test(name + " at level " + std::to_string(level));
+		check(block.size() <= lz4::compressBound(contents.size()), test + " fits in its bound");
+		check(decompresses(block, contents), test + " round trips");
+#if defined(REFERENCE_LZ4)
+		std::vector<char> out(contents.size() + 1);
+		int size(LZ4_decompress_safe(block.data(), out.data(), (int)block.size(), (int)out.size()));
+		check(size == (int)contents.size() && !contents.compare(0, contents.size(), out.data(), contents.size()), test + " is read by the reference decoder");
+#endif
+	}
+}
+
+int main() {
+	struct Case {
+		std::string name;
+		std::string contents;
+		std::string reference; // The block the reference library writes for the contents
+	};
+	std::vector<Case> cases = {
+		{ "empty", std::string(),
+			std::string("\x00", 1) },
+		{ "incompressible", noise(64, 1),
+			std::string("\xf0\x31\xc6\x7e\x81\x6b\x4b\xfb\xe2\xfb\x54\xf6\xbd\xdf\x7c\x1c\xe1\x87\x01\xbf\x31\xde\x56\x72"
+				"\x0f\x47\x67\x66\x87\x59\xaa\x88\x3c\x59\xea\x56\x13\x7b\xd2\x85\xa1\xd8\x3c\x54\x55\x2f\x37\xae"
+				"\x65\x5b\xda\x02\x79\x98\xcc\xe3\x1a\x76\x8e\x5f\xd9\x99\x8f\x1f\x3f\x36", 66) },
+		{ "long match", noise(300, 2) + noise(300, 2) + noise(20, 3),
+			std::string("\xff\xff\x1e\x8c\x21\xff\x72\xed\xd7\x18\xd9\x4e\x13\x95\x13\xdc\x1b\x63\xfc\x93\x06\xf6\xbf\x9c"
+				"\xe5\x06\xe0\x6d\xb0\x0a\x05\x9f\xf2\x75\x87\x8e\x34\xb3\xbc\xb3\x2b\xe2\x02\xc0\xa1\x51\x8c\x80"
+				"\x23\xb9\xec\x6d\x6f\x3d\x64\x0e\x9c\x23\xec\x17\x07\x50\x03\x3f\x01\x85\x36\xdf\x3a\x5c\x71\x4f"
+				"\xec\x00\x09\x00\xc7\xaf\x85\x59\xa0\xf1\x30\x53\xd8\x95\x5f\xd3\x8d\x70\x82\xca\x83\xd5\xed\x0f"
+				"\xd1\xd3\x64\xf7\x4b\x31\x68\xba\xb3\x2b\x44\x85\x9e\xe9\xd6\x5e\x28\xc3\x1e\xbc\x57\x37\x88\xe2"
+				"\x50\xa6\xf9\xff\x3c\xd1\x9c\x07\xf7\x17\x69\x4f\x7f\x6c\x7a\xeb\x17\x19\x0d\xc7\x3e\x36\x58\x88"
+				"\x53\xe7\x10\x20\x05\x59\xb8\x33\x7c\x7b\xaa\x2d\x49\x7d\xe6\x20\x0e\x09\x9e\x5e\xed\x44\x7d\xda"
+				"\xb1\x83\xbb\x3f\xbf\xcd\xe2\xce\xbb\x15\x5d\xf8\xf9\x34\xc5\xbf\xaa\xa8\xeb\xcd\xc3\x0f\xa5\x51"
+				"\xac\x61\x59\x9d\xae\xf0\x4b\x81\x19\x21\xa6\x65\x38\xe8\x4c\x28\xf6\x05\x5d\xbc\x4c\x00\x89\x7d"
+				"\x72\xe5\x16\x56\xc1\xc0\xb0\x92\x6a\xd7\xf4\x83\xd9\xaa\xbb\xd5\xe7\xab\x26\xaf\xc2\xbd\x6e\x8f"
+				"\x9c\x6e\x69\xe2\x16\xf5\xdb\x66\x6b\xea\x82\x40\x5d\xc7\xdf\xdd\xe0\x23\xc6\x89\x87\xa8\xa5\xd0"
+				"\xb2\xd9\x94\x98\x75\x86\x20\xfa\x47\x0a\xd7\xe5\x6f\x4b\x93\x71\x2e\x6f\x87\x04\xad\x5e\x0b\x27"
+				"\xa5\xfc\x27\x26\xd0\x23\xe1\x69\x13\x63\x47\x95\x68\x79\x3b\x2c\x01\xff\x1a\xf0\x05\x53\xc3\x7d"
+				"\x78\x8e\xb4\x4d\xb7\x48\x2f\x6d\x46\x3d\x19\xe5\x70\x24\x4c\xbb\xa0", 329) },
+		{ "overlapping copy", std::string(200, 'x') + repeated("abc", 60) + "tail!",
+			std::string("\x1f\x78\x01\x00\xb4\x3f\x61\x62\x63\x03\x00\x9e\x50\x74\x61\x69\x6c\x21", 18) },
+	};
+
+	for (const auto& c : cases) {
+		check(decompresses(c.reference, c.contents), c.name + " reference block decompresses");
+		roundTrip(c.name, c.contents);
+
+		// A block missing its end is malformed, rather than shorter
+		if (c.reference.size() > 1) {
+			check(!decompresses(c.reference.substr(0, c.reference.size() - 1), c.contents), c.name + " truncated reference block is rejected");
+		}
+	}
+	check(!decompresses(std::string("\x1f\x78\x02\x00", 4), std::string(20, 'x')), "match before the start of the block is rejected");
+	check(!decompresses(std::string("\x10\x78\x00\x00", 4), std::string(5, 'x')), "match with no distance is rejected");
+
+	// Larger inputs, mixing text, runs and noise
+	std::string mixed;
+	for (int i = 0; i < 2000; ++i) {
+		mixed += "line " + std::to_string(i % 97) + ": " + (i % 3 ? repeated("ab", i % 40) : noise(i % 50, i)) + "\n";
+	}
+	roundTrip("mixed", mixed);
+	roundTrip("noise", noise(100000, 4));
+
+#if defined(REFERENCE_LZ4)
+	for (int level = 1; level <= 12; level += 11) {
+		std::vector<char> block(LZ4_compressBound((int)mixed.size()));
+		int size(LZ4_compress_HC(mixed.data(), block.data(), (int)mixed.size(), (int)block.size(), level));
+		check(size > 0 && decompresses(std::string(block.data(), size), mixed), "reference HC block at level " + std::to_string(level) + " decompresses");
+	}
+#endif
+
+	// Compressed objects: Several blocks, the last short, and one stored as it is since it doesn't compress
+	std::string contents(repeated(mixed, 20) + noise(encoding::BLOCK_SIZE, 5) + "end");
+	std::stringstream object;
+	check(encoding::encode(contents.data(), contents.size(), object, 1) > 0, "object encodes");
+	std::string decoded;
+	check(encoding::decode(object, [&decoded](const char* data, size_t size) { decoded.append(data, size); }), "object decodes");
+	check(decoded == contents, "object round trips");
+
+	std::istringstream corrupt(encoding::MAGIC + "\nsize 12x\nblock 1048576\n&&&&&\n");
+	uint64_t size, blockSize;
+	check(!encoding::readHeader(corrupt, size, blockSize), "corrupt object header is rejected");
+	std::istringstream overflow(encoding::MAGIC + "\nsize 99999999999999999999999\nblock 1048576\n&&&&&\n");
+	check(!encoding::readHeader(overflow, size, blockSize), "object header with an overflowing size is rejected");
+
+	if (failures) {
+		std::cerr << failures << " tests failed.\n";
+		return 1;
+	}
+	std::cout << "All compression tests passed.\n";
+	return 0;
+}
@@ -0,0 +1,17 @@
+#!/bin/bash
+
+# Tests the LZ4 codec and compressed objects
+# Set LZ4_REFERENCE to the prefix of an installed LZ4 library (like /usr) to also check against the reference implementation
+
+CXX=${CXX:-g++}
+
+if [ -n "$LZ4_REFERENCE" ]; then
+	$CXX -std=c++14 -O2 -DREFERENCE_LZ4 -I"$LZ4_REFERENCE/include" compressionTest.cpp -o compressionTest -L"$LZ4_REFERENCE/lib" -Wl,-rpath,"$LZ4_REFERENCE/lib" -llz4 || exit 1
+else
+	$CXX -std=c++14 -O2 compressionTest.cpp -o compressionTest || exit 1
+fi
+
+./compressionTest
+result=$?
+rm -f compressionTest
+exit $result
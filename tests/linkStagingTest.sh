@@ -0,0 +1,71 @@
+#!/bin/bash
+
+# Tests that staging files as hard links commits what each file held, even when files share their contents
+# Identical files share one index entry. Editing one of them between add and commit must neither change what was staged
+#   for the others nor stop the commit, whether the files were added together or one at a time.
+# Set HERO to test a hero other than the Debug build.
+
+HERO=${HERO:-$(pwd)/../x64/Debug/hero.exe}
+WORK=$(pwd)/linkStagingTest.work
+
+rm -fr "$WORK"
+mkdir -p "$WORK/repo"
+cd "$WORK/repo" || exit 1
+
+fail() {
+	echo "FAILED: $1"
+	exit 1
+}
+
+# Commits what's in the index, then checks each file in the commit out again and compares it with what it held when it was added
+# Takes the names of the files, each of which must have a copy named <file>.added
+checkCommit() {
+	printf "$1\n\030\n" | "$HERO" commit > /dev/null || fail "commit of $1"
+	shift
+	[ -z "$(ls .hero/commits | grep -i partial)" ] || fail "partial commit left behind"
+	rm -f "$@"
+	"$HERO" checkout HEAD --incremental > /dev/null 2>&1 || fail "checkout after $1"
+	for file in "$@"; do
+		cmp -s "$file" "$file.added" || fail "$file differs from what was added"
+	done
+}
+
+"$HERO" init > /dev/null || fail "init"
+sed -i 's/^staging .*$/staging link/' .hero/config
+grep -q "^staging link" .hero/config || echo "staging link" >> .hero/config
+
+# Identical files added together, one of them edited before commit
+echo same > a.txt
+echo same > b.txt
+cp a.txt a.txt.added
+cp b.txt b.txt.added
+"$HERO" add a.txt b.txt > /dev/null || fail "add of a.txt and b.txt"
+echo edited >> a.txt
+checkCommit "together" a.txt b.txt
+
+# Identical files added one at a time, the first of them edited before commit
+seq 1 1000 > c.txt
+seq 1 1000 > d.txt
+cp c.txt c.txt.added
+cp d.txt d.txt.added
+"$HERO" add c.txt > /dev/null || fail "add of c.txt"
+"$HERO" add d.txt > /dev/null || fail "add of d.txt"
+echo edited >> c.txt
+checkCommit "one at a time" c.txt d.txt
+
+# A file with contents of its own stays linked until commit, so an edit made before then is what gets committed
+echo alone > e.txt
+"$HERO" add e.txt > /dev/null || fail "add of e.txt"
+echo edited >> e.txt
+cp e.txt e.txt.added
+checkCommit "alone" e.txt
+
+# Every commit must still be usable afterwards
+"$HERO" status > /dev/null || fail "status"
+echo more > f.txt
+cp f.txt f.txt.added
+"$HERO" add f.txt > /dev/null || fail "add of f.txt"
+checkCommit "after" f.txt
+
+cd / && rm -fr "$WORK"
+echo "All link staging tests passed."
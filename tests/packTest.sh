@@ -0,0 +1,63 @@
+#!/bin/bash
+
+# Tests that packing keeps every version of every file
+# Commits several versions of some files, packs them (so similar versions are stored as deltas of each other),
+#   commits and packs again, then checks each version out and compares it with what was committed.
+# Set HERO to test a hero other than the Debug build.
+
+HERO=${HERO:-$(pwd)/../x64/Debug/hero.exe}
+WORK=$(pwd)/packTest.work
+
+rm -fr "$WORK"
+mkdir -p "$WORK/repo" "$WORK/expected"
+cd "$WORK/repo" || exit 1
+
+fail() {
+	echo "FAILED: $1"
+	exit 1
+}
+
+# Commits every file in the working directory, and keeps a copy of them to compare against
+commitVersion() {
+	"$HERO" add text.txt noise.bin empty.txt > /dev/null || fail "add for version $1"
+	printf "version $1\n\030\n" | "$HERO" commit > /dev/null || fail "commit of version $1"
+	mkdir "$WORK/expected/$1"
+	cp text.txt noise.bin empty.txt "$WORK/expected/$1/"
+	cat .hero/HEAD > "$WORK/expected/$1/hash"
+}
+
+"$HERO" init > /dev/null || fail "init"
+
+# Text which compresses and deltas well, noise which does neither, and an empty file
+seq 1 20000 > text.txt
+head -c 200000 /dev/urandom > noise.bin
+: > empty.txt
+commitVersion 1
+
+sed -i 's/^1234$/changed/' text.txt
+commitVersion 2
+
+seq 5000 30000 >> text.txt
+head -c 1000 /dev/urandom >> noise.bin
+commitVersion 3
+
+"$HERO" pack || fail "first pack"
+
+# Another version after packing, so the next pack holds both packed and loose objects
+sed -i '1d' text.txt
+echo "not empty" > empty.txt
+commitVersion 4
+
+"$HERO" pack || fail "second pack"
+[ -z "$(ls .hero/objects)" ] || fail "objects left loose after packing"
+
+for version in 1 2 3 4; do
+	"$HERO" checkout "$(cat "$WORK/expected/$version/hash")" --incremental > /dev/null 2>&1 || fail "checkout of version $version"
+	for file in text.txt noise.bin empty.txt; do
+		cmp -s "$file" "$WORK/expected/$version/$file" || fail "$file differs in version $version"
+	done
+done
+"$HERO" checkout HEAD --incremental > /dev/null 2>&1 || fail "checkout of HEAD"
+
+cd / && rm -fr "$WORK"
+echo "All pack tests passed."